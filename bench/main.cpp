@@ -0,0 +1,351 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#include "../common/bounded_queue.h"
+#include "../common/cpu_dispatch.h"
+#include "../common/pnm.h"
+#include "../common/profile.h"
+#include "../common/thread_pool.h"
+#include "../hw7-phoenix-1202/zlib/zlib.h"
+
+/// Every lab is a single translation unit with its own main(), so each one is compiled here inside its own
+/// namespace (the headers above are already included, so their guards keep them out of the namespaces)
+
+namespace lab1 {
+#include "../hw1-phoenix-1202/main.cpp"
+}
+
+namespace lab2 {
+#include "../hw2-phoenix-1202/main.cpp"
+}
+
+namespace lab3 {
+#include "../hw3-phoenix-1202/main.cpp"
+}
+
+namespace lab4 {
+#include "../hw4-phoenix-1202/main.cpp"
+}
+
+namespace lab5 {
+#include "../hw5-phoenix-1202/main.cpp"
+}
+
+namespace lab7 {
+#include "../hw7-phoenix-1202/main.cpp"
+}
+
+using namespace std;
+
+struct Options {
+    vector<double> sizes = {1, 4, 16};
+    int reps = 3;
+    int threads = 1;
+    bool json = false;
+    string labs = "123457";
+    string dir = filesystem::temp_directory_path().string();
+};
+
+struct Result {
+    string lab, kernel, params;
+    int width, height;
+    size_t bytes;
+    double seconds;
+};
+
+static Options options;
+
+static void report(const Result& r) {
+    double megapixels = (double) r.width * r.height / 1e6;
+    if (options.json) {
+        printf("{\"lab\":\"%s\",\"kernel\":\"%s\",\"params\":\"%s\",\"width\":%d,\"height\":%d,\"megapixels\":%.3f,"
+               "\"seconds\":%.6f,\"mp_per_s\":%.3f,\"bytes_per_s\":%.0f}\n",
+               r.lab.c_str(), r.kernel.c_str(), r.params.c_str(), r.width, r.height, megapixels,
+               r.seconds, megapixels / r.seconds, r.bytes / r.seconds);
+    } else {
+        printf("%s,%s,%s,%d,%d,%.3f,%.6f,%.3f,%.0f\n", r.lab.c_str(), r.kernel.c_str(), r.params.c_str(),
+               r.width, r.height, megapixels, r.seconds, megapixels / r.seconds, r.bytes / r.seconds);
+    }
+    fflush(stdout);
+}
+
+static double seconds(const function<void()>& body) {
+    auto start = chrono::steady_clock::now();
+    body();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/// Best of options.reps runs; setup is not timed
+static double best(const function<void()>& setup, const function<void()>& body) {
+    double result = 1e100;
+    for (int i = 0; i < options.reps; i++) {
+        setup();
+        result = min(result, seconds(body));
+    }
+    return result;
+}
+
+/// Smooth gradients plus noise, so neither the kernels nor zlib see a degenerate image
+static string make_pnm(int type, int width, int height) {
+    pnm::Header header;
+    header.type = type;
+    header.width = width;
+    header.height = height;
+    unsigned char* data = pnm::allocate(header.dataSize());
+    if (data == nullptr) {
+        cerr << "Not enough memory for the synthetic image";
+        exit(1);
+    }
+    mt19937 generator(12345);
+    int channels = header.channels();
+    for (int i = 0; i < height; i++) {
+        unsigned char* row = data + (size_t) i * header.rowSize();
+        for (int j = 0; j < width; j++)
+            for (int k = 0; k < channels; k++)
+                row[j * channels + k] = (unsigned char) ((j * 255 / max(1, width - 1) * (k + 1) + i / 4 +
+                                                          generator() % 32) % 256);
+    }
+    string path = (filesystem::path(options.dir) / ("bench_" + to_string(width) + "x" + to_string(height) +
+                                                     (type == 6 ? ".ppm" : ".pgm"))).string();
+    if (pnm::write(path.c_str(), header, data) != pnm::Ok) {
+        cerr << "Cannot write the synthetic image to " << path;
+        exit(1);
+    }
+    pnm::release(data);
+    return path;
+}
+
+static void write_be32(string& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out += (char) (value >> shift);
+}
+
+static void add_png_chunk(string& out, const char* type, const string& chunk) {
+    write_be32(out, (uint32_t) chunk.size());
+    string body = string(type, 4) + chunk;
+    out += body;
+    write_be32(out, (uint32_t) crc32(0, (const Bytef*) body.data(), (uInt) body.size()));
+}
+
+/// 8-bit PNG whose rows cycle through all five filter types (filter bytes only, the samples stay as generated)
+static string make_png(const string& pnm_path, int width, int height) {
+    pnm::Header header;
+    unsigned char* data;
+    if (pnm::read(pnm_path.c_str(), header, data) != pnm::Ok) {
+        cerr << "Cannot read the synthetic image";
+        exit(1);
+    }
+    size_t row_size = header.rowSize();
+    string raw;
+    raw.reserve((row_size + 1) * height);
+    for (int i = 0; i < height; i++) {
+        raw += (char) (i % 5);
+        raw.append((const char*) data + i * row_size, row_size);
+    }
+    pnm::release(data);
+    uLongf compressed_size = compressBound(raw.size());
+    string compressed(compressed_size, '\0');
+    if (compress2((Bytef*) &compressed[0], &compressed_size, (const Bytef*) raw.data(), raw.size(), 6) != Z_OK) {
+        cerr << "Cannot compress the synthetic png";
+        exit(1);
+    }
+    compressed.resize(compressed_size);
+    string ihdr;
+    write_be32(ihdr, width);
+    write_be32(ihdr, height);
+    ihdr += (char) 8;
+    ihdr += (char) (header.type == 6 ? 2 : 0);
+    ihdr += string(3, '\0');
+    string png = "\x89PNG\r\n\x1a\n";
+    add_png_chunk(png, "IHDR", ihdr);
+    add_png_chunk(png, "IDAT", compressed);
+    add_png_chunk(png, "IEND", "");
+    string path = pnm_path + ".png";
+    ofstream file(path, ios::binary);
+    file.write(png.data(), png.size());
+    if (!file) {
+        cerr << "Cannot write the synthetic png to " << path;
+        exit(1);
+    }
+    return path;
+}
+
+/// doEffects alone only touches a freshly read, cache-hot raster in place (or not at all for an even chain),
+/// so the timed region runs up to the written output file, as the lab itself does
+static void bench_lab1(const string& pgm, const string& ppm, int width, int height) {
+    ThreadPool pool(options.threads);
+    for (const string& path : {pgm, ppm}) {
+        int channels = (path == ppm) ? 3 : 1;
+        string out = path + ".out";
+        unique_ptr<lab1::Image> image;
+        for (int effect = 0; effect <= 4; effect++) {
+            double time = best([&] { image = make_unique<lab1::Image>(path.c_str()); }, [&] {
+                image->doEffects({effect}, pool);
+                image->write(out.c_str());
+            });
+            report({"hw1", "effect_" + to_string(effect), channels == 3 ? "P6" : "P5", width, height,
+                    (size_t) width * height * channels, time});
+        }
+        filesystem::remove(out);
+    }
+}
+
+static void bench_lab2(const string& ppm, int width, int height) {
+    const char* spaces[] = {"RGB", "HSL", "HSV", "YCbCr.601", "YCbCr.709", "YCoCg", "CMY"};
+    ThreadPool pool(options.threads);
+    unique_ptr<lab2::Image> image;
+    for (bool fast : {true, false})
+        for (const char* from : spaces)
+            for (const char* to : spaces) {
+                double time = best([&] {
+                    image = make_unique<lab2::Image>(ppm.c_str());
+                    image->set_fast(fast);
+                }, [&] { image->convert(from, to, &pool); });
+                report({"hw2", fast ? "convert" : "convert_reference", string(from) + "->" + to, width, height,
+                        (size_t) width * height * 3, time});
+            }
+    // the same pairs through a baked 33^3 LUT (baking is not timed)
+    for (const char* from : spaces)
+        for (const char* to : spaces) {
+            lab2::Conversion conversion{from, to, true, &pool};
+            lab2::Lut3D lut = lab2::bake_lut(conversion, 33);
+            conversion.lut = &lut;
+            double time = best([&] { image = make_unique<lab2::Image>(ppm.c_str()); },
+                               [&] { image->convert(conversion, false); });
+            report({"hw2", "lut_33", string(from) + "->" + to, width, height, (size_t) width * height * 3, time});
+        }
+}
+
+static void bench_lab3(const string& pgm, int width, int height) {
+    lab3::Image image(pgm.c_str(), 0);
+    // the blue-noise mask is generated once per run, as in the lab, and not inside the timed dither_8 calls
+    lab3::Mask mask = lab3::Mask::blue_noise();
+    image.set_mask(mask);
+    for (int dither = 0; dither <= 8; dither++)
+        for (int bits = 1; bits <= 8; bits++) {
+            double time = best([] {}, [&] { image.dither(dither, bits, 0); });
+            report({"hw3", "dither_" + to_string(dither), "bits=" + to_string(bits), width, height,
+                    (size_t) width * height, time});
+        }
+}
+
+static void bench_lab4(const string& pgm, const string& ppm, int width, int height) {
+    int new_width = width * 3 / 2, new_height = height * 3 / 2;
+    for (const string& path : {pgm, ppm}) {
+        int channels = (path == ppm) ? 3 : 1;
+        unique_ptr<lab4::Image> image;
+        for (int algorithm = 0; algorithm <= 3; algorithm++) {
+            double time = best([&] {
+                image = make_unique<lab4::Image>(path.c_str());
+                image->set_new_sizes(new_width, new_height);
+                image->set_new_params(1, 0, 0);
+            }, [&] { image->do_algorithm(algorithm); });
+            report({"hw4", "resize_" + to_string(algorithm),
+                    string(channels == 3 ? "P6" : "P5") + " to " + to_string(new_width) + "x" + to_string(new_height),
+                    width, height, (size_t) width * height * channels, time});
+        }
+    }
+}
+
+static void bench_lab5(const string& pgm, int width, int height) {
+    unique_ptr<lab5::Image> image;
+    for (int classes = 2; classes <= 4; classes++) {
+        double time = best([&] { image = make_unique<lab5::Image>(pgm.c_str()); },
+                           [&] { image->multi_Otsu_tresholding(classes - 1); });
+        report({"hw5", "multi_otsu", "classes=" + to_string(classes), width, height, (size_t) width * height, time});
+    }
+}
+
+static void bench_lab7(const string& pgm, const string& ppm, int width, int height) {
+    for (const string& path : {pgm, ppm}) {
+        int channels = (path == ppm) ? 3 : 1;
+        string png = make_png(path, width, height);
+        double time = best([] {}, [&] { lab7::PNGImage image(png.c_str()); });
+        report({"hw7", "png_decode", channels == 3 ? "RGB" : "gray", width, height,
+                (size_t) width * height * channels, time});
+        filesystem::remove(png);
+    }
+}
+
+static vector<double> parse_sizes(const string& list) {
+    vector<double> sizes;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+        sizes.push_back(stod(item));
+    return sizes;
+}
+
+int main(int argc, char* argv[]) {
+    cpu::parseFlag(argc, argv);
+    lab1::rowKernels = lab1::selectRowKernels();
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--json")
+                options.json = true;
+            else if (arg == "--sizes" && i + 1 < argc)
+                options.sizes = parse_sizes(argv[++i]);
+            else if (arg == "--reps" && i + 1 < argc)
+                options.reps = max(1, stoi(argv[++i]));
+            else if (arg == "--threads" && i + 1 < argc)
+                options.threads = max(1, stoi(argv[++i]));
+            else if (arg == "--labs" && i + 1 < argc)
+                options.labs = argv[++i];
+            else if (arg == "--dir" && i + 1 < argc)
+                options.dir = argv[++i];
+            else
+                throw invalid_argument(arg);
+        }
+    } catch (const exception& e) {
+        cerr << "Usage: bench [--sizes <megapixels,...>] [--reps <n>] [--threads <n>] [--labs <digits>] "
+                "[--dir <temp dir>] [--json] [--cpu <scalar|sse4.1|avx2|avx512>]";
+        exit(1);
+    }
+    if (!options.json)
+        printf("lab,kernel,params,width,height,megapixels,seconds,mp_per_s,bytes_per_s\n");
+    for (double megapixels : options.sizes) {
+        // 4:3 images of the requested size
+        int width = max(1, (int) lround(sqrt(megapixels * 1e6 * 4 / 3)));
+        int height = max(1, (int) lround(megapixels * 1e6 / width));
+        string pgm = make_pnm(5, width, height);
+        string ppm = make_pnm(6, width, height);
+        if (options.labs.find('1') != string::npos)
+            bench_lab1(pgm, ppm, width, height);
+        if (options.labs.find('2') != string::npos)
+            bench_lab2(ppm, width, height);
+        if (options.labs.find('3') != string::npos)
+            bench_lab3(pgm, width, height);
+        if (options.labs.find('4') != string::npos)
+            bench_lab4(pgm, ppm, width, height);
+        if (options.labs.find('5') != string::npos)
+            bench_lab5(pgm, width, height);
+        if (options.labs.find('7') != string::npos)
+            bench_lab7(pgm, ppm, width, height);
+        filesystem::remove(pgm);
+        filesystem::remove(ppm);
+    }
+    return 0;
+}
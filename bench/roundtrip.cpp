@@ -0,0 +1,266 @@
+#include <iostream>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#include "../common/bounded_queue.h"
+#include "../common/cpu_dispatch.h"
+#include "../common/pnm.h"
+#include "../common/profile.h"
+#include "../common/thread_pool.h"
+
+/// lab2 compiled inside a namespace, as in bench/main.cpp
+
+namespace lab2 {
+#include "../hw2-phoenix-1202/main.cpp"
+}
+
+using namespace std;
+
+/// Every 8-bit RGB triple (red fastest), 2^24 interleaved pixels
+static vector<unsigned char> all_triples() {
+    const size_t pixels = 1 << 24;
+    vector<unsigned char> rgb(3 * pixels);
+    for (size_t pixel = 0; pixel < pixels; pixel++) {
+        rgb[3 * pixel] = (unsigned char) pixel;
+        rgb[3 * pixel + 1] = (unsigned char) (pixel >> 8);
+        rgb[3 * pixel + 2] = (unsigned char) (pixel >> 16);
+    }
+    return rgb;
+}
+
+static double seconds(const function<void()>& body) {
+    auto start = chrono::steady_clock::now();
+    body();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/// Largest round-trip error per channel value of the reference and fast kernels and largest difference of the
+/// fast forward result from the reference one, per space; a looser kernel fails the run
+struct Limits {
+    int round_trip, vs_reference;
+};
+
+static const unordered_map<string, Limits> round_trip_limits = {
+        {"HSL", {9, 1}}, {"HSV", {10, 1}}, {"YCbCr.601", {3, 1}}, {"YCbCr.709", {3, 1}}, {"YCoCg", {2, 1}},
+        {"CMY", {0, 0}}};
+
+/// Runs RGB -> space -> RGB over every triple and prints one CSV row: the error of the round trip per channel
+/// value (largest, mean, share of triples that come back exactly, first triple with the largest error), the
+/// largest difference of the forward result from the reference one, the speed of each direction (best of
+/// reps) and whether the errors are within round_trip_limits (LUT rows depend on --lut and are not checked).
+/// An empty reference is filled with this forward result instead.
+static bool round_trip(const vector<unsigned char>& rgb, const string& kernel, const lab2::Conversion& forward,
+                       const lab2::Conversion& inverse, vector<unsigned char>& reference, int reps) {
+    size_t pixels = rgb.size() / 3;
+    vector<unsigned char> work(rgb.size());
+    lab2::Pixels layout = {work.data(), 3, 1};
+    double forward_time = 1e100, inverse_time = 1e100;
+    int forward_error = 0;
+    for (int rep = 0; rep < reps; rep++) {
+        copy(rgb.begin(), rgb.end(), work.begin());
+        forward_time = min(forward_time, seconds([&] { forward.apply(layout, layout, pixels); }));
+        if (rep == 0 && reference.empty())
+            reference = work;
+        else if (rep == 0) {
+            for (size_t i = 0; i < work.size(); i++)
+                forward_error = max(forward_error, abs(work[i] - reference[i]));
+        }
+        inverse_time = min(inverse_time, seconds([&] { inverse.apply(layout, layout, pixels); }));
+    }
+    int max_error = 0;
+    size_t worst = 0, exact = 0;
+    uint64_t total = 0;
+    for (size_t pixel = 0; pixel < pixels; pixel++) {
+        int error = 0;
+        for (int c = 0; c < 3; c++) {
+            int difference = abs(work[3 * pixel + c] - rgb[3 * pixel + c]);
+            total += difference;
+            error = max(error, difference);
+        }
+        exact += (error == 0);
+        if (error > max_error) {
+            max_error = error;
+            worst = pixel;
+        }
+    }
+    const char* status = "-";
+    bool ok = true;
+    if (kernel == "reference" || kernel == "fast") {
+        const Limits& limits = round_trip_limits.at(forward.to_colorspace);
+        ok = max_error <= limits.round_trip && forward_error <= limits.vs_reference;
+        status = ok ? "ok" : "FAIL";
+    }
+    printf("%s,%s,%d,%.4f,%.2f,%d %d %d,%d,%.1f,%.1f,%s\n", kernel.c_str(), forward.to_colorspace.c_str(),
+           max_error, (double) total / rgb.size(), 100.0 * exact / pixels, rgb[3 * worst], rgb[3 * worst + 1],
+           rgb[3 * worst + 2], forward_error, pixels / 1e6 / forward_time, pixels / 1e6 / inverse_time, status);
+    fflush(stdout);
+    return ok;
+}
+
+/// Every pair of the spaces through the reference per-pixel math composed in one double pass, with the
+/// intermediate RGB not rounded: what a fused fast pass computes, up to its last bits
+using ExactSpaces = lab2::PassTable<unsigned char, double, lab2::RGB_space, lab2::HSL_space, lab2::HSV_space,
+                                    lab2::YCbCr_space<lab2::BT601>, lab2::YCbCr_space<lab2::BT709>,
+                                    lab2::YCoCg_space, lab2::CMY_space>;
+
+/// Largest difference of a fused pass from the exact composition
+static int exact_limit(const string& from, const string& to) {
+    return (from == "YCoCg" && (to == "HSL" || to == "HSV")) ? 2 : 1;
+}
+
+/// Largest difference of a fused pass from the -k reference result, which rounds the intermediate RGB to bytes;
+/// the chroma of YCbCr and YCoCg amplifies that rounding, and for HSL and HSV targets it moves the hue and the
+/// saturation of dark and near-grey pixels arbitrarily, so those are not checked (-1)
+static int reference_limit(const string& from, const string& to) {
+    if (to == "HSL" || to == "HSV")
+        return -1;
+    return (from == "HSV" && to != "CMY") ? 2 : 1;
+}
+
+/// X -> Y for two non-RGB spaces, where the fast kernels fuse both halves into one pass. Every byte triple is
+/// taken as a pixel of `from`; prints the largest difference of the fast result from the exact composition and
+/// from the -k reference one, the first input triple with the largest exact difference and whether both are
+/// within their limits. The hue of HSL and HSV targets is compared around the circle, and not at all where the
+/// exact saturation is below 8 (the hue of near-grey pixels is noise).
+static bool fused_pair(const vector<unsigned char>& input, const string& from, const string& to, ThreadPool& pool) {
+    size_t pixels = input.size() / 3;
+    vector<unsigned char> fast = input, reference = input, exact = input;
+    lab2::Conversion{from, to, true, &pool}.apply(lab2::Pixels{fast.data(), 3, 1}, {fast.data(), 3, 1}, pixels);
+    lab2::Conversion{from, to, false, &pool}.apply(lab2::Pixels{reference.data(), 3, 1}, {reference.data(), 3, 1},
+                                                   pixels);
+    ExactSpaces::passes[lab2::colorspace_index(from)][lab2::colorspace_index(to)](
+            lab2::Pixels{exact.data(), 3, 1}, {exact.data(), 3, 1}, pixels);
+    bool hue = (to == "HSL" || to == "HSV");
+    int exact_error = 0, reference_error = 0;
+    size_t worst = 0;
+    for (size_t i = 0; i < fast.size(); i++) {
+        int error = abs(fast[i] - exact[i]);
+        if (hue && i % 3 == 0)
+            error = (exact[i + 1] < 8) ? 0 : min(error, 256 - error);
+        if (error > exact_error) {
+            exact_error = error;
+            worst = i / 3;
+        }
+        reference_error = max(reference_error, abs(fast[i] - reference[i]));
+    }
+    int limit = reference_limit(from, to);
+    bool ok = exact_error <= exact_limit(from, to) && (limit < 0 || reference_error <= limit);
+    printf("%s,%s,%d,%d,%d %d %d,%s\n", from.c_str(), to.c_str(), exact_error, reference_error, input[3 * worst],
+           input[3 * worst + 1], input[3 * worst + 2], ok ? "ok" : "FAIL");
+    fflush(stdout);
+    return ok;
+}
+
+/// Every 16-bit sample value in every channel through identity LUTs of the given size, baked from RGB -> RGB and
+/// (up to 65^3, past which the text gets large) loaded from a .cube file with 6 decimals: a wide LUT keeps float
+/// outputs, so the samples must come back exactly
+static bool wide_identity(int size, ThreadPool& pool) {
+    const size_t pixels = 1 << 16;
+    vector<unsigned char> raw(6 * pixels), result(raw.size());
+    for (size_t k = 0; k < pixels; k++) {
+        pnm::writeSample16(&raw[6 * k], (unsigned) k);
+        pnm::writeSample16(&raw[6 * k + 2], (unsigned) (65535 - k));
+        pnm::writeSample16(&raw[6 * k + 4], (unsigned) (k * 7919 % 65536));
+    }
+    lab2::Conversion identity{"RGB", "RGB", true, &pool};
+    vector<lab2::Lut3D> luts = {lab2::bake_lut(identity, size, true)};
+    if (size <= 65) {
+        string cube_path = (filesystem::temp_directory_path() / "roundtrip_identity.cube").string();
+        ofstream cube(cube_path);
+        cube << "LUT_3D_SIZE " << size << "\n";
+        char line[64];
+        for (int point = 0; point < size * size * size; point++) {
+            snprintf(line, sizeof(line), "%.6f %.6f %.6f\n", (double) (point % size) / (size - 1),
+                     (double) (point / size % size) / (size - 1), (double) (point / size / size) / (size - 1));
+            cube << line;
+        }
+        cube.close();
+        luts.push_back(lab2::Lut3D::load(cube_path.c_str(), true));
+        filesystem::remove(cube_path);
+    }
+    bool ok = true;
+    for (size_t source = 0; source < luts.size(); source++) {
+        vector<float> samples(3 * pixels);
+        lab2::load_wide(raw.data(), samples.size(), 65535, samples.data());
+        identity.lut = &luts[source];
+        identity.apply(lab2::FloatPixels{samples.data(), 3, 1}, {samples.data(), 3, 1}, pixels);
+        lab2::store_wide(samples.data(), samples.size(), 65535, result.data());
+        int max_error = 0;
+        for (size_t i = 0; i < samples.size(); i++)
+            max_error = max(max_error, abs((int) pnm::readSample16(&result[2 * i]) -
+                                           (int) pnm::readSample16(&raw[2 * i])));
+        printf("%s,%d,%d,%s\n", source == 0 ? "baked" : "cube", size, max_error, max_error == 0 ? "ok" : "FAIL");
+        ok = ok && max_error == 0;
+    }
+    fflush(stdout);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    cpu::parseFlag(argc, argv);
+    int threads = 1, reps = 3, lut_size = 0;
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--threads" && i + 1 < argc)
+                threads = max(1, stoi(argv[++i]));
+            else if (arg == "--reps" && i + 1 < argc)
+                reps = max(1, stoi(argv[++i]));
+            else if (arg == "--lut" && i + 1 < argc)
+                lut_size = min(256, max(2, stoi(argv[++i])));
+            else
+                throw invalid_argument(arg);
+        }
+    } catch (const exception& e) {
+        cerr << "Usage: roundtrip [--threads <n>] [--reps <n>] [--lut <2..256>] [--cpu <scalar|sse4.1|avx2|avx512>]";
+        exit(1);
+    }
+    const char* spaces[] = {"HSL", "HSV", "YCbCr.601", "YCbCr.709", "YCoCg", "CMY"};
+    vector<unsigned char> rgb = all_triples();
+    ThreadPool pool(threads);
+    bool ok = true;
+    printf("kernel,space,max_error,mean_error,exact_percent,worst_rgb,to_max_vs_reference,to_mp_per_s,"
+           "from_mp_per_s,status\n");
+    for (const char* space : spaces) {
+        vector<unsigned char> reference;
+        for (bool fast : {false, true})
+            ok = round_trip(rgb, fast ? "fast" : "reference", {"RGB", space, fast, &pool},
+                            {space, "RGB", fast, &pool}, reference, reps) && ok;
+        if (lut_size == 0)
+            continue;
+        // both directions baked from the fast kernels
+        lab2::Conversion forward{"RGB", space, true, &pool}, inverse{space, "RGB", true, &pool};
+        lab2::Lut3D forward_lut = lab2::bake_lut(forward, lut_size), inverse_lut = lab2::bake_lut(inverse, lut_size);
+        forward.lut = &forward_lut;
+        inverse.lut = &inverse_lut;
+        round_trip(rgb, "lut_" + to_string(lut_size), forward, inverse, reference, reps);
+    }
+    printf("from,to,fast_max_vs_exact,fast_max_vs_reference,worst_input,status\n");
+    for (const char* from : spaces)
+        for (const char* to : spaces)
+            if (strcmp(from, to) != 0)
+                ok = fused_pair(rgb, from, to, pool) && ok;
+    printf("wide_identity_lut,size,max_error_16bit,status\n");
+    for (int size : {2, 17, 33, 65, 256})
+        ok = wide_identity(size, pool) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,48 @@
+#ifndef COMMON_BOUNDED_QUEUE_H
+#define COMMON_BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// Blocking queue with a fixed capacity; pop() returns false once the queue is closed and drained
+template<typename T>
+struct BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(m);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(m);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.erase(items.begin());
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    std::vector<T> items;
+    size_t capacity;
+    bool closed = false;
+    std::mutex m;
+    std::condition_variable notFull, notEmpty;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef COMMON_CPU_DISPATCH_H
+#define COMMON_CPU_DISPATCH_H
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH_X86
+#endif
+
+/// Runtime choice between scalar, SSE4.1, AVX2 and AVX-512 variants of the hot loops, so one binary runs
+/// everywhere and still uses the full vector width of the machine it lands on.
+///
+/// A kernel is written once as an always-inline lambda; cpu::run instantiates it inside a wrapper compiled for
+/// each instruction set and calls the one matching cpu::level(). The level is detected from cpuid on first use
+/// and can be lowered with --cpu <scalar|sse4.1|avx2|avx512> to test the other variants on the same machine.
+/// Floating-point contraction is disabled in the wrappers, so every variant produces the same bytes as the
+/// scalar one.
+namespace cpu {
+
+enum Level {Scalar, SSE41, AVX2, AVX512};
+
+inline const char* name(Level level) {
+    switch (level) {
+        case SSE41:
+            return "sse4.1";
+        case AVX2:
+            return "avx2";
+        case AVX512:
+            return "avx512";
+        default:
+            return "scalar";
+    }
+}
+
+inline Level detect() {
+#ifdef CPU_DISPATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl"))
+        return AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SSE41;
+#endif
+    return Scalar;
+}
+
+/// The best supported level, fixed the first time anyone asks
+inline Level supported() {
+    static const Level level = detect();
+    return level;
+}
+
+inline Level& level() {
+    static Level current = supported();
+    return current;
+}
+
+/// Removes --cpu <level> from the arguments and applies it; asking for more than the CPU has is an error
+inline void parseFlag(int& argc, char* argv[]) {
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") != 0) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        if (i + 1 == argc) {
+            std::cerr << "Incorrect --cpu value; must be one of scalar, sse4.1, avx2, avx512";
+            exit(1);
+        }
+        const char* value = argv[++i];
+        Level requested = Scalar;
+        while (strcmp(value, name(requested)) != 0) {
+            if (requested == AVX512) {
+                std::cerr << "Incorrect --cpu value; must be one of scalar, sse4.1, avx2, avx512";
+                exit(1);
+            }
+            requested = (Level) (requested + 1);
+        }
+        if (requested > supported()) {
+            std::cerr << "This CPU does not support " << value << "; the best available level is "
+                      << name(supported());
+            exit(1);
+        }
+        level() = requested;
+    }
+    argc = kept;
+    argv[argc] = nullptr;
+}
+
+#define CPU_KERNEL __attribute__((always_inline))
+
+#ifdef CPU_DISPATCH_X86
+// vectorize even at -O2, but never contract a * b + c into an FMA (that would change the rounding)
+#define CPU_DISPATCH_OPTIMIZE optimize("tree-vectorize,vect-cost-model=dynamic,fp-contract=off")
+
+template <class Kernel, class... Args>
+__attribute__((target("sse4.1"), CPU_DISPATCH_OPTIMIZE)) void runSSE41(const Kernel& kernel, Args... args) {
+    kernel(args...);
+}
+
+template <class Kernel, class... Args>
+__attribute__((target("avx2"), CPU_DISPATCH_OPTIMIZE)) void runAVX2(const Kernel& kernel, Args... args) {
+    kernel(args...);
+}
+
+template <class Kernel, class... Args>
+__attribute__((target("avx512f,avx512bw,avx512vl"), CPU_DISPATCH_OPTIMIZE))
+void runAVX512(const Kernel& kernel, Args... args) {
+    kernel(args...);
+}
+#endif
+
+/// Runs a kernel (a lambda marked CPU_KERNEL) compiled for the selected level. Pointers and sizes should be
+/// passed as arguments rather than captured: a capture is reloaded after every byte store, which stops the
+/// loops from vectorizing.
+template <class Kernel, class... Args>
+void run(const Kernel& kernel, Args... args) {
+#ifdef CPU_DISPATCH_X86
+    switch (level()) {
+        case AVX512:
+            runAVX512(kernel, args...);
+            return;
+        case AVX2:
+            runAVX2(kernel, args...);
+            return;
+        case SSE41:
+            runSSE41(kernel, args...);
+            return;
+        default:
+            break;
+    }
+#endif
+    kernel(args...);
+}
+
+}
+
+#endif
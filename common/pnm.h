@@ -0,0 +1,294 @@
+#ifndef COMMON_PNM_H
+#define COMMON_PNM_H
+
+#include <atomic>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <new>
+
+#ifndef _WIN32
+#define PNM_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/// PNM (P5/P6) reading and writing shared by all labs: 64-bit sizes, 64-byte aligned rasters read with a single
+/// fread (or mapped), header comments, and 8- or 16-bit samples (maxval up to 65535, 16-bit samples are big-endian)
+namespace pnm {
+
+const size_t alignment = 64;
+
+/// Bytes that go through mappings rather than read()/write() (see profile.h): the raster of a mapped input, and
+/// the whole of a mapped output, whose header is copied into the mapping too
+inline std::atomic<long long> mappedBytesRead{0}, mappedBytesWritten{0};
+
+enum Status {
+    Ok,
+    OpenFailed,
+    BadFormat,
+    NoMemory,
+    ReadFailed,
+    WriteFailed
+};
+
+inline const char* message(Status status) {
+    switch (status) {
+        case OpenFailed:
+            return "Cannot open the image file: problems with file";
+        case BadFormat:
+            return "Incorrect image format: must be P5 or P6 type";
+        case NoMemory:
+            return "Cannot open image file: not enough memory";
+        case ReadFailed:
+            return "Problems with reading the image file";
+        case WriteFailed:
+            return "Problems with writing image to outfile";
+        default:
+            return "";
+    }
+}
+
+struct Header {
+    int type = 5;
+    int width = 0, height = 0;
+    int maxval = 255;
+
+    int channels() const {
+        return type == 6 ? 3 : 1;
+    }
+
+    int sampleSize() const {
+        return maxval > 255 ? 2 : 1;
+    }
+
+    size_t pixelSize() const {
+        return (size_t) channels() * sampleSize();
+    }
+
+    size_t rowSize() const {
+        return (size_t) width * pixelSize();
+    }
+
+    size_t dataSize() const {
+        return rowSize() * height;
+    }
+};
+
+inline unsigned char* allocate(size_t size) {
+    return new (std::align_val_t(alignment), std::nothrow) unsigned char[size == 0 ? 1 : size];
+}
+
+inline void release(unsigned char* data) {
+    if (data != nullptr)
+        operator delete[](data, std::align_val_t(alignment));
+}
+
+inline unsigned readSample16(const unsigned char* p) {
+    return (unsigned) p[0] << 8 | p[1];
+}
+
+inline void writeSample16(unsigned char* p, unsigned value) {
+    p[0] = (unsigned char) (value >> 8);
+    p[1] = (unsigned char) value;
+}
+
+// whitespace and '#' comments between header fields
+inline bool readHeaderNumber(FILE* file, int& value) {
+    int c = getc(file);
+    while (true) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF)
+                c = getc(file);
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f') {
+            c = getc(file);
+        } else {
+            break;
+        }
+    }
+    if (c < '0' || c > '9')
+        return false;
+    long long result = 0;
+    while (c >= '0' && c <= '9') {
+        result = result * 10 + (c - '0');
+        if (result > INT32_MAX)
+            return false;
+        c = getc(file);
+    }
+    value = (int) result;
+    // exactly one whitespace character separates maxval from the raster
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/// Leaves the file positioned at the first raster byte
+inline Status readHeader(FILE* file, Header& header) {
+    if (getc(file) != 'P')
+        return BadFormat;
+    int t = getc(file);
+    if (t != '5' && t != '6')
+        return BadFormat;
+    header.type = t - '0';
+    if (!readHeaderNumber(file, header.width) || !readHeaderNumber(file, header.height) ||
+            !readHeaderNumber(file, header.maxval))
+        return BadFormat;
+    if (header.width <= 0 || header.height <= 0 || header.maxval <= 0 || header.maxval > 65535)
+        return BadFormat;
+    return Ok;
+}
+
+/// data is allocated with allocate() and must be freed with release()
+inline Status read(const char* path, Header& header, unsigned char*& data) {
+    data = nullptr;
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+        return OpenFailed;
+    Status status = readHeader(file, header);
+    if (status == Ok) {
+        size_t size = header.dataSize();
+        data = allocate(size);
+        if (data == nullptr)
+            status = NoMemory;
+        else if (fread(data, 1, size, file) != size)
+            status = ReadFailed;
+    }
+    fclose(file);
+    if (status != Ok) {
+        release(data);
+        data = nullptr;
+    }
+    return status;
+}
+
+inline bool writeHeader(FILE* file, const Header& header) {
+    return fprintf(file, "P%d\n%d %d\n%d\n", header.type, header.width, header.height, header.maxval) >= 0;
+}
+
+inline Status write(const char* path, const Header& header, const unsigned char* data) {
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr)
+        return OpenFailed;
+    size_t size = header.dataSize();
+    bool ok = writeHeader(file, header) && fwrite(data, 1, size, file) == size;
+    return (fclose(file) == 0 && ok) ? Ok : WriteFailed;
+}
+
+/// Raster of a memory-mapped file; data points to the first raster byte
+struct Mapping {
+    unsigned char* data = nullptr;
+    void* base = nullptr;
+    size_t length = 0;
+};
+
+/// Read-only mapping of an existing file; fails with OpenFailed when mapping is not available
+inline Status mapRead(const char* path, Header& header, Mapping& mapping) {
+#ifdef PNM_MMAP
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+        return OpenFailed;
+    // unbuffered, so reading the header does not also read (and count) the start of the raster
+    setvbuf(file, nullptr, _IONBF, 0);
+    Status status = readHeader(file, header);
+    struct stat fileStat{};
+    if (status == Ok && fstat(fileno(file), &fileStat) == 0) {
+        size_t offset = ftell(file);
+        mapping.length = offset + header.dataSize();
+        if ((size_t) fileStat.st_size < mapping.length) {
+            status = ReadFailed;
+        } else {
+            mapping.base = mmap(nullptr, mapping.length, PROT_READ, MAP_SHARED, fileno(file), 0);
+            if (mapping.base == MAP_FAILED) {
+                status = OpenFailed;
+            } else {
+                mapping.data = (unsigned char*) mapping.base + offset;
+                mappedBytesRead += header.dataSize();
+            }
+        }
+    } else if (status == Ok) {
+        status = OpenFailed;
+    }
+    fclose(file);
+    return status;
+#else
+    (void) path;
+    (void) header;
+    (void) mapping;
+    return OpenFailed;
+#endif
+}
+
+/// Creates (or truncates) the file, writes the header and maps it for writing the raster
+inline Status mapWrite(const char* path, const Header& header, Mapping& mapping) {
+#ifdef PNM_MMAP
+    char text[64];
+    size_t offset = snprintf(text, sizeof(text), "P%d\n%d %d\n%d\n", header.type, header.width, header.height,
+                             header.maxval);
+    mapping.length = offset + header.dataSize();
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return OpenFailed;
+    mapping.base = MAP_FAILED;
+    if (ftruncate(fd, mapping.length) == 0)
+        mapping.base = mmap(nullptr, mapping.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping.base == MAP_FAILED)
+        return WriteFailed;
+    memcpy(mapping.base, text, offset);
+    mapping.data = (unsigned char*) mapping.base + offset;
+    mappedBytesWritten += mapping.length;
+    return Ok;
+#else
+    (void) path;
+    (void) header;
+    (void) mapping;
+    return OpenFailed;
+#endif
+}
+
+/// Flushes a writable mapping back to its file and unmaps it; false when either step fails
+inline bool unmap(Mapping& mapping) {
+#ifdef PNM_MMAP
+    bool ok = true;
+    if (mapping.base != nullptr) {
+        ok = msync(mapping.base, mapping.length, MS_SYNC) == 0;
+        ok = munmap(mapping.base, mapping.length) == 0 && ok;
+    }
+    mapping = Mapping();
+    return ok;
+#else
+    (void) mapping;
+    return false;
+#endif
+}
+
+/// Gives back the resident pages of a finished part of a mapping (whole pages inside [begin, end) only);
+/// shared file pages stay in the page cache, so written data is kept
+inline void dropPages(const unsigned char* begin, const unsigned char* end) {
+#ifdef PNM_MMAP
+    auto page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t from = ((uintptr_t) begin + page - 1) / page * page;
+    uintptr_t to = (uintptr_t) end / page * page;
+    if (from < to)
+        madvise((void*) from, to - from, MADV_DONTNEED);
+#else
+    (void) begin;
+    (void) end;
+#endif
+}
+
+inline bool sameFile(const char* a, const char* b) {
+#ifdef PNM_MMAP
+    struct stat aStat{}, bStat{};
+    return stat(a, &aStat) == 0 && stat(b, &bStat) == 0 && aStat.st_dev == bStat.st_dev && aStat.st_ino == bStat.st_ino;
+#else
+    (void) a;
+    (void) b;
+    return false;
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef COMMON_PROFILE_H
+#define COMMON_PROFILE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "pnm.h"
+
+/// --profile support: each stage of a lab (read, process, write...) is reported as one JSON line on stderr
+/// with wall and CPU time, bytes read and written, peak RSS and the number of allocations made during it.
+///
+/// The counting operator new / delete below are replacement functions, so this header must be included by
+/// exactly one translation unit of a program (every lab is a single main.cpp).
+namespace profile {
+
+inline bool enabled = false;
+inline std::atomic<long long> allocations{0};
+
+struct Counters {
+    double wall = 0, cpu = 0;
+    long long bytesRead = 0, bytesWritten = 0, allocations = 0;
+};
+
+inline double cpuSeconds() {
+#ifndef _WIN32
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return (double) usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           (double) usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+inline long long peakRssKb() {
+#ifndef _WIN32
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// read()/write() traffic from /proc/self/io where available, plus whatever pnm mapped instead of reading. Reading
+// /proc/self/io itself shows up in rchar, so the bytes read here are kept and taken back out.
+inline void ioBytes(long long& read, long long& written) {
+    read = pnm::mappedBytesRead;
+    written = pnm::mappedBytesWritten;
+#ifndef _WIN32
+    static std::atomic<long long> ownBytes{0};
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0)
+        return;
+    char text[512];
+    size_t length = 0;
+    ssize_t got;
+    while (length < sizeof(text) - 1 && (got = ::read(fd, text + length, sizeof(text) - 1 - length)) > 0)
+        length += got;
+    close(fd);
+    text[length] = '\0';
+    long long own = ownBytes.fetch_add((long long) length);
+    const char* rchar = strstr(text, "rchar:");
+    const char* wchar = strstr(text, "wchar:");
+    if (rchar != nullptr)
+        read += atoll(rchar + 6) - own;
+    if (wchar != nullptr)
+        written += atoll(wchar + 6);
+#endif
+}
+
+inline Counters now() {
+    Counters counters;
+    counters.wall = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    counters.cpu = cpuSeconds();
+    ioBytes(counters.bytesRead, counters.bytesWritten);
+    counters.allocations = allocations.load(std::memory_order_relaxed);
+    return counters;
+}
+
+inline const char*& currentStage() {
+    static const char* name = nullptr;
+    return name;
+}
+
+inline Counters& stageStart() {
+    static Counters start;
+    return start;
+}
+
+/// Reports the running stage, if any
+inline void finish() {
+    if (!enabled || currentStage() == nullptr)
+        return;
+    Counters end = now();
+    const Counters& start = stageStart();
+    fprintf(stderr, "{\"stage\":\"%s\",\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes_read\":%lld,\"bytes_written\":%lld,"
+                    "\"peak_rss_kb\":%lld,\"allocations\":%lld}\n",
+            currentStage(), (end.wall - start.wall) * 1e3, (end.cpu - start.cpu) * 1e3,
+            end.bytesRead - start.bytesRead, end.bytesWritten - start.bytesWritten, peakRssKb(),
+            end.allocations - start.allocations);
+    currentStage() = nullptr;
+}
+
+/// Drops the running stage without reporting it (e.g. a fast path that turned out not to apply)
+inline void discard() {
+    currentStage() = nullptr;
+}
+
+/// Ends the running stage and starts the next one
+inline void stage(const char* name) {
+    if (!enabled)
+        return;
+    finish();
+    currentStage() = name;
+    stageStart() = now();
+}
+
+/// Removes --profile from the arguments (so the lab's own argument checks are unchanged) and enables reporting
+inline void parseFlag(int& argc, char* argv[]) {
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0)
+            enabled = true;
+        else
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+    argv[argc] = nullptr;
+}
+
+inline void* allocate(size_t size, size_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0)
+        size = 1;
+    if (alignment <= alignof(std::max_align_t))
+        return malloc(size);
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* result = nullptr;
+    return posix_memalign(&result, alignment, size) == 0 ? result : nullptr;
+#endif
+}
+
+inline void release(void* pointer, size_t alignment) {
+#ifdef _WIN32
+    if (alignment > alignof(std::max_align_t)) {
+        _aligned_free(pointer);
+        return;
+    }
+#endif
+    (void) alignment;
+    free(pointer);
+}
+
+inline void* allocateOrThrow(size_t size, size_t alignment) {
+    void* result = allocate(size, alignment);
+    if (result == nullptr)
+        throw std::bad_alloc();
+    return result;
+}
+
+}
+
+void* operator new(size_t size) {
+    return profile::allocateOrThrow(size, 0);
+}
+
+void* operator new[](size_t size) {
+    return profile::allocateOrThrow(size, 0);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return profile::allocate(size, 0);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return profile::allocate(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return profile::allocateOrThrow(size, (size_t) alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return profile::allocateOrThrow(size, (size_t) alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return profile::allocate(size, (size_t) alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return profile::allocate(size, (size_t) alignment);
+}
+
+void operator delete(void* pointer) noexcept {
+    profile::release(pointer, 0);
+}
+
+void operator delete[](void* pointer) noexcept {
+    profile::release(pointer, 0);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    profile::release(pointer, 0);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+    profile::release(pointer, 0);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+    profile::release(pointer, 0);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+    profile::release(pointer, 0);
+}
+
+void operator delete(void* pointer, std::align_val_t alignment) noexcept {
+    profile::release(pointer, (size_t) alignment);
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept {
+    profile::release(pointer, (size_t) alignment);
+}
+
+void operator delete(void* pointer, size_t, std::align_val_t alignment) noexcept {
+    profile::release(pointer, (size_t) alignment);
+}
+
+void operator delete[](void* pointer, size_t, std::align_val_t alignment) noexcept {
+    profile::release(pointer, (size_t) alignment);
+}
+
+void operator delete(void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    profile::release(pointer, (size_t) alignment);
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    profile::release(pointer, (size_t) alignment);
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef COMMON_THREAD_POOL_H
+#define COMMON_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of workers; run() hands out task indices until all are done, the calling thread helps too.
+///
+/// Indices are taken one at a time from a shared counter, so a thread that finishes its task early just takes
+/// the next one: with many more tasks than threads, uneven tasks balance out the way work stealing would.
+struct ThreadPool {
+public:
+    explicit ThreadPool(int threads) {
+        for (int i = 1; i < threads; i++)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    void run(int tasks, const std::function<void(int)>& task) {
+        if (workers.empty() || tasks <= 1) {
+            for (int i = 0; i < tasks; i++)
+                task(i);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m);
+        current = &task;
+        taskCount = tasks;
+        next = 0;
+        finished = 0;
+        generation++;
+        lock.unlock();
+        wake.notify_all();
+        work();
+        lock.lock();
+        done.wait(lock, [this] { return finished == taskCount && active == 0; });
+        current = nullptr;
+    }
+
+    /// Workers and the calling thread: how many tasks can run at once
+    int threadCount() const {
+        return (int) workers.size() + 1;
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable wake, done;
+    const std::function<void(int)>* current = nullptr;
+    std::atomic<int> next{0};
+    int taskCount = 0, finished = 0, active = 0;
+    long long generation = 0;
+    bool stopping = false;
+
+    void work() {
+        int completed = 0;
+        for (int i = next++; i < taskCount; i = next++) {
+            (*current)(i);
+            completed++;
+        }
+        std::lock_guard<std::mutex> lock(m);
+        finished += completed;
+    }
+
+    void workerLoop() {
+        long long seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                wake.wait(lock, [&] { return stopping || (generation != seen && current != nullptr); });
+                if (stopping)
+                    return;
+                seen = generation;
+                active++;
+            }
+            work();
+            {
+                std::lock_guard<std::mutex> lock(m);
+                active--;
+            }
+            done.notify_one();
+        }
+    }
+};
+
+#endif
@@ -1,153 +1,590 @@
 #include <iostream>
+#include <algorithm>
 #include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+
+#include "../common/bounded_queue.h"
+#include "../common/cpu_dispatch.h"
+#include "../common/pnm.h"
+#include "../common/profile.h"
+#include "../common/thread_pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HW1_X86_SIMD
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+/// Row kernels: dst and src never overlap unless the row is not reversed; mask is 0 or 255 (inversion)
+
+static void xorRowScalar(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    for (size_t k = 0; k < n; k++)
+        dst[k] = src[k] ^ mask;
+}
+
+static void reverseRow1Scalar(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    for (size_t k = 0; k < n; k++)
+        dst[k] = src[n - 1 - k] ^ mask;
+}
+
+static void reverseRow3Scalar(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    for (size_t k = 0; k < n; k++) {
+        const unsigned char* in = src + (n - 1 - k) * 3;
+        dst[k * 3] = in[0] ^ mask;
+        dst[k * 3 + 1] = in[1] ^ mask;
+        dst[k * 3 + 2] = in[2] ^ mask;
+    }
+}
+
+#ifdef HW1_X86_SIMD
+
+__attribute__((target("sse2")))
+static void xorRowSSE2(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    __m128i m = _mm_set1_epi8((char) mask);
+    size_t k = 0;
+    for (; k + 16 <= n; k += 16)
+        _mm_storeu_si128((__m128i*) (dst + k), _mm_xor_si128(_mm_loadu_si128((const __m128i*) (src + k)), m));
+    xorRowScalar(dst + k, src + k, n - k, mask);
+}
+
+__attribute__((target("avx2")))
+static void xorRowAVX2(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    __m256i m = _mm256_set1_epi8((char) mask);
+    size_t k = 0;
+    for (; k + 32 <= n; k += 32)
+        _mm256_storeu_si256((__m256i*) (dst + k), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (src + k)), m));
+    xorRowScalar(dst + k, src + k, n - k, mask);
+}
+
+// SSE2 has no byte shuffle: reverse dwords, then words inside dwords, then bytes inside words
+__attribute__((target("sse2")))
+static void reverseRow1SSE2(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    __m128i m = _mm_set1_epi8((char) mask);
+    size_t k = 0;
+    for (; k + 16 <= n; k += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (src + n - k - 16));
+        x = _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3));
+        x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+        x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128((__m128i*) (dst + k), _mm_xor_si128(x, m));
+    }
+    for (; k < n; k++)
+        dst[k] = src[n - 1 - k] ^ mask;
+}
+
+__attribute__((target("avx2")))
+static void reverseRow1AVX2(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    const __m256i order = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                           15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m256i m = _mm256_set1_epi8((char) mask);
+    size_t k = 0;
+    for (; k + 32 <= n; k += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (src + n - k - 32));
+        x = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, order), _MM_SHUFFLE(1, 0, 3, 2));
+        _mm256_storeu_si256((__m256i*) (dst + k), _mm256_xor_si256(x, m));
+    }
+    for (; k < n; k++)
+        dst[k] = src[n - 1 - k] ^ mask;
+}
+
+// 5 pixels (15 bytes) per shuffle; the load starts one byte early and the 16th stored byte is rewritten
+// by the next step, so neither side touches memory outside the row
+__attribute__((target("ssse3")))
+static void reverseRow3SSSE3(unsigned char* dst, const unsigned char* src, size_t n, unsigned char mask) {
+    const __m128i order = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -128);
+    __m128i m = _mm_set1_epi8((char) mask);
+    size_t k = 0;
+    for (; k + 6 <= n; k += 5) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (src + (n - k - 5) * 3 - 1));
+        _mm_storeu_si128((__m128i*) (dst + k * 3), _mm_xor_si128(_mm_shuffle_epi8(x, order), m));
+    }
+    reverseRow3Scalar(dst + k * 3, src, n - k, mask);
+}
+
+#endif
+
+struct RowKernels {
+    void (*xorRow)(unsigned char*, const unsigned char*, size_t, unsigned char);
+    void (*reverseRow1)(unsigned char*, const unsigned char*, size_t, unsigned char);
+    void (*reverseRow3)(unsigned char*, const unsigned char*, size_t, unsigned char);
+};
+
+/// SSE4.1 implies SSE2 and SSSE3, so the 128-bit kernels are taken from that level up
+static RowKernels selectRowKernels() {
+    RowKernels kernels = {xorRowScalar, reverseRow1Scalar, reverseRow3Scalar};
+#ifdef HW1_X86_SIMD
+    if (cpu::level() >= cpu::SSE41) {
+        kernels.xorRow = xorRowSSE2;
+        kernels.reverseRow1 = reverseRow1SSE2;
+        kernels.reverseRow3 = reverseRow3SSSE3;
+    }
+    if (cpu::level() >= cpu::AVX2) {
+        kernels.xorRow = xorRowAVX2;
+        kernels.reverseRow1 = reverseRow1AVX2;
+    }
+#endif
+    return kernels;
+}
+
+// reselected in main once --cpu is known
+static RowKernels rowKernels = selectRowKernels();
+
 struct Image {
 public:
     explicit Image(const char* infile) {
-        FILE* file = fopen(infile, "rb");
-        if (file == nullptr) {
-            cerr << "Cannot open the image file: problems with file";
+        const char* error = read(infile);
+        if (error != nullptr) {
+            cerr << error;
             exit(1);
         }
-        char f, endOfLine;
-        int w, h, maxColor, t;
-        if (fscanf(file, "%c%d%d%d%d%c", &f, &t, &w, &h, &maxColor, &endOfLine) == 6 &&
-                f == 'P' && (t == 5 || t == 6) && maxColor == 255 && endOfLine == '\n') {
-            width = w;
-            height = h;
-            type = t;
-            if (type == 6)
-                pixelSize = 3;
-            size = width * height * pixelSize;
-            data = new (nothrow) unsigned char[size];
-            if (data == nullptr) {
-                cerr << "Cannot open image file: not enough memory";
-                exit(1);
-            }
-            if (fread(data, 1, size, file) != size) {
-                cerr << "Problems with reading the image file";
-                exit(1);
+    }
+
+    /// For the batch mode: nullptr (and the reason in error) instead of exiting when the file cannot be used
+    static unique_ptr<Image> tryRead(const char* infile, const char*& error) {
+        unique_ptr<Image> image(new Image());
+        error = image->read(infile);
+        if (error != nullptr)
+            image.reset();
+        return image;
+    }
+
+    void doEffects(const vector<int>& effects, ThreadPool& pool) {
+        Transform transform;
+        for (int effect : effects)
+            transform.add(effect);
+        apply(transform, pool);
+    }
+
+    /// Streams a non-transposing chain from the mapped input file straight into the mapped output file,
+    /// band by band, dropping finished pages so the resident set does not grow with the image.
+    /// Returns false (and touches nothing) when the chain or the files do not allow it.
+    static bool doEffectsMapped(const char* infile, const char* outfile, const vector<int>& effects, ThreadPool& pool) {
+        Transform t;
+        for (int effect : effects)
+            t.add(effect);
+        if (t.transpose || pnm::sameFile(infile, outfile))
+            return false;
+        pnm::Header header;
+        pnm::Mapping in, out;
+        if (pnm::mapRead(infile, header, in) != pnm::Ok)
+            return false;
+        if (header.maxval != 255) {
+            pnm::unmap(in);
+            return false;
+        }
+        pnm::Status status = pnm::mapWrite(outfile, header, out);
+        if (status != pnm::Ok) {
+            cerr << pnm::message(status);
+            exit(1);
+        }
+        int w = header.width, h = header.height;
+        size_t rowSize = header.rowSize();
+        const unsigned char* src = in.data;
+        unsigned char* dst = out.data;
+        unsigned char mask = t.invert ? 255 : 0;
+        int bands = (h + mappedBandRows - 1) / mappedBandRows;
+        pool.run(bands, [&](int band) {
+            int i0 = band * mappedBandRows;
+            int i1 = min(h, i0 + mappedBandRows);
+            for (int i = i0; i < i1; i++) {
+                const unsigned char* srcRow = src + (size_t) (t.flipV ? h - 1 - i : i) * rowSize;
+                unsigned char* dstRow = dst + (size_t) i * rowSize;
+                if (!t.flipH)
+                    rowKernels.xorRow(dstRow, srcRow, rowSize, mask);
+                else if (header.type == 6)
+                    rowKernels.reverseRow3(dstRow, srcRow, w, mask);
+                else
+                    rowKernels.reverseRow1(dstRow, srcRow, w, mask);
             }
-        } else {
-            cerr << "Incorrect image format: must be P5 or P6 type with maxColorValue = 255";
+            size_t first = (size_t) (t.flipV ? h - i1 : i0) * rowSize;
+            pnm::dropPages(src + first, src + first + (i1 - i0) * rowSize);
+            pnm::dropPages(dst + (size_t) i0 * rowSize, dst + (size_t) i1 * rowSize);
+        });
+        pnm::unmap(in);
+        if (!pnm::unmap(out)) {
+            cerr << "Problems with writing image to outfile";
             exit(1);
         }
-        fclose(file);
+        return true;
     }
 
-    void doEffect(int effect) {
-        switch (effect) {
-            case 0:
-                inversion();
-                break;
-            case 1:
-                horizontalMirror();
-                break;
-            case 2:
-                verticalMirror();
-                break;
-            case 3:
-                rotateRight();
-                break;
-            case 4:
-                rotateLeft();
-                break;
-            default:
-                cerr << "Incorrect effect; please enter an integer from 0 to 4";
-                exit(1);
+    void write(const char* outfile) {
+        pnm::Status status = tryWrite(outfile);
+        if (status == pnm::OpenFailed) {
+            cerr << "Cannot open the image file: problems with file";
+            exit(1);
         }
+        if (status != pnm::Ok) {
+            cerr << "Problems with writing image to outfile";
+            exit(1);
+        }
+    }
+
+    pnm::Status tryWrite(const char* outfile) {
+        header.width = width;
+        header.height = height;
+        return pnm::write(outfile, header, data);
+    }
+
+    ~Image() {
+        pnm::release(data);
     }
 
-    void inversion() {
-        for (int i = 0; i < size; i++)
-            data[i] = (unsigned char)(255 - (int)data[i]);
+private:
+    pnm::Header header;
+    unsigned char* data = nullptr;
+    int width, height, pixelSize = 1;
+    size_t size;
+
+    Image() = default;
+
+    // the error message, or nullptr once the image is loaded
+    const char* read(const char* infile) {
+        pnm::Status status = pnm::read(infile, header, data);
+        if (status == pnm::BadFormat || (status == pnm::Ok && header.maxval != 255))
+            return "Incorrect image format: must be P5 or P6 type with maxColorValue = 255";
+        if (status != pnm::Ok)
+            return pnm::message(status);
+        width = header.width;
+        height = header.height;
+        pixelSize = header.channels();
+        size = header.dataSize();
+        return nullptr;
     }
 
-    void horizontalMirror() {
-        for (int i = 0; i < height; i++)
-            for (int j = 0; j < width / 2; j++) {
-                int x = (i * width + j) * pixelSize;
-                int y = (i * width + width - 1 - j) * pixelSize;
-                for (int k = 0; k < pixelSize; k++)
-                    swap(data[x + k], data[y + k]);
+    /// Source rows per transposed strip: the 64 cache lines a column reads stay in L1 for the next columns, and
+    /// every column becomes one contiguous run of its destination row
+    static const int stripRows = 64;
+
+    struct Pixel3 {
+        unsigned char c[3];
+    };
+
+    /// Element of the dihedral group of the rectangle (optional transpose, then optional mirrors) plus inversion
+    struct Transform {
+        bool transpose = false, flipH = false, flipV = false, invert = false;
+
+        void add(int effect) {
+            switch (effect) {
+                case 0:
+                    invert = !invert;
+                    break;
+                case 1:
+                    flipH = !flipH;
+                    break;
+                case 2:
+                    flipV = !flipV;
+                    break;
+                case 3:
+                    addTranspose();
+                    flipH = !flipH;
+                    break;
+                case 4:
+                    addTranspose();
+                    flipV = !flipV;
+                    break;
+                default:
+                    cerr << "Incorrect effect; please enter an integer from 0 to 4";
+                    exit(1);
             }
+        }
+
+        // transposing after a mirror turns a horizontal mirror into a vertical one and vice versa
+        void addTranspose() {
+            transpose = !transpose;
+            swap(flipH, flipV);
+        }
+    };
+
+    /// Rows (or row pairs for vertical mirroring) per task of the in-place pass
+    static const int bandRows = 32;
+
+    /// Rows per task of the mapped pass, after which the band's pages are released
+    static const int mappedBandRows = 64;
+
+
+    void apply(const Transform& t, ThreadPool& pool) {
+        if (t.transpose)
+            applyTransposed(t, pool);
+        else
+            applyInPlace(t, pool);
     }
 
-    void verticalMirror() {
-        for (int j = 0; j < width; j++)
-            for (int i = 0; i < height / 2; i++) {
-                int x = (i * width + j) * pixelSize;
-                int y = ((height - 1 - i) * width + j) * pixelSize;
-                for (int k = 0; k < pixelSize; k++)
-                    swap(data[x + k], data[y + k]);
+    // row i and its mirror row are read once and written once, so any non-transposing chain is a single pass;
+    // a band always owns both rows of each of its pairs, so bands never touch each other's rows
+    void applyInPlace(const Transform& t, ThreadPool& pool) {
+        if (!t.flipH && !t.flipV && !t.invert)
+            return;
+        size_t rowSize = (size_t) width * pixelSize;
+        int rows = t.flipV ? (height + 1) / 2 : height;
+        pool.run((rows + bandRows - 1) / bandRows, [&](int band) {
+            auto* tmp = new (nothrow) unsigned char[rowSize];
+            if (tmp == nullptr) {
+                cerr << "Out of memory exception";
+                exit(1);
+            }
+            for (int i = band * bandRows; i < min(rows, (band + 1) * bandRows); i++) {
+                unsigned char* a = data + (size_t) i * rowSize;
+                unsigned char* b = data + (size_t) (t.flipV ? height - 1 - i : i) * rowSize;
+                if (a != b) {
+                    memcpy(tmp, a, rowSize);
+                    transformRow(a, b, t.flipH, t.invert);
+                    transformRow(b, tmp, t.flipH, t.invert);
+                } else if (t.flipH) {
+                    memcpy(tmp, a, rowSize);
+                    transformRow(a, tmp, true, t.invert);
+                } else {
+                    transformRow(a, a, false, t.invert);
+                }
             }
+            delete[] tmp;
+        });
+    }
+
+    void transformRow(unsigned char* dst, const unsigned char* src, bool reverse, bool invert) const {
+        unsigned char mask = invert ? 255 : 0;
+        if (!reverse)
+            rowKernels.xorRow(dst, src, (size_t) width * pixelSize, mask);
+        else if (pixelSize == 3)
+            rowKernels.reverseRow3(dst, src, width, mask);
+        else
+            rowKernels.reverseRow1(dst, src, width, mask);
     }
 
-    void rotateRight() {
-        auto* newData = new (nothrow) unsigned char[size];
+    // every task takes one strip of stripRows source rows, i.e. a disjoint strip of destination columns
+    void applyTransposed(const Transform& t, ThreadPool& pool) {
+        unsigned char* newData = pnm::allocate(size);
         if (newData == nullptr) {
             cerr << "Out of memory exception";
             exit(1);
         }
-        int n = 0;
-        for (int j = 0; j < width; j++)
-            for (int i = height - 1; i >= 0; i--) {
-                int x = (i * width + j) * pixelSize;
-                for (int k = 0; k < pixelSize; k++) {
-                    newData[n] = data[x + k];
-                    n++;
-                }
+        pool.run((height + stripRows - 1) / stripRows, [&](int strip) {
+            int i0 = strip * stripRows;
+            int i1 = min(i0 + stripRows, height);
+            if (pixelSize == 3) {
+                if (t.invert)
+                    transposeStrip<Pixel3, true>((const Pixel3*) data, (Pixel3*) newData, width, height, i0, i1, t.flipH, t.flipV);
+                else
+                    transposeStrip<Pixel3, false>((const Pixel3*) data, (Pixel3*) newData, width, height, i0, i1, t.flipH, t.flipV);
+            } else {
+                if (t.invert)
+                    transposeStrip<unsigned char, true>(data, newData, width, height, i0, i1, t.flipH, t.flipV);
+                else
+                    transposeStrip<unsigned char, false>(data, newData, width, height, i0, i1, t.flipH, t.flipV);
             }
+        });
         swap(height, width);
-        memcpy(data, newData, size);
-        delete[] newData;
+        pnm::release(data);
+        data = newData;
     }
 
-    void rotateLeft() {
-        rotateRight();
-        verticalMirror();
-        horizontalMirror();
+    static unsigned char inverted(unsigned char p) {
+        return (unsigned char) ~p;
     }
 
-    void write(const char* outfile) {
-        FILE* file = fopen(outfile, "wb");
-        if (file == nullptr) {
-            cerr << "Cannot open the image file: problems with file";
-            exit(1);
+    static Pixel3 inverted(Pixel3 p) {
+        for (unsigned char& c : p.c)
+            c = (unsigned char) ~c;
+        return p;
+    }
+
+    // dst is w x h: src(i, j) goes to dst(flipV ? w - 1 - j : j, flipH ? h - 1 - i : i), for source rows i0..i1 - 1
+    template<typename Pixel, bool Invert>
+    static void transposeStrip(const Pixel* src, Pixel* dst, int w, int h, int i0, int i1, bool flipH, bool flipV) {
+        ptrdiff_t step = flipH ? -1 : 1;
+        for (int j = 0; j < w; j++) {
+            Pixel* out = dst + (size_t) (flipV ? w - 1 - j : j) * h + (flipH ? h - 1 - i0 : i0);
+            const Pixel* in = src + (size_t) i0 * w + j;
+            for (int i = i0; i < i1; i++) {
+                *out = Invert ? inverted(*in) : *in;
+                out += step;
+                in += w;
+            }
         }
-        if (fprintf(file, "P%d\n%d %d\n%d\n", type, width, height, 255) < 0 ||
-                fwrite(data, 1, size, file) != size) {
-            cerr << "Problems with writing image to outfile";
+    }
+};
+
+/// Batch input is either a directory (every .pgm/.ppm/.pnm file in it) or a manifest with one image path per line
+vector<string> collectBatchInputs(const char* list) {
+    vector<string> inputs;
+    error_code error;
+    if (filesystem::is_directory(list, error)) {
+        for (const auto& entry : filesystem::directory_iterator(list, error)) {
+            string extension = entry.path().extension().string();
+            if (entry.is_regular_file() && (extension == ".pgm" || extension == ".ppm" || extension == ".pnm"))
+                inputs.push_back(entry.path().string());
+        }
+        if (error) {
+            cerr << "Cannot read the batch directory";
             exit(1);
         }
-        fclose(file);
+        sort(inputs.begin(), inputs.end());
+        return inputs;
     }
-
-    ~Image() {
-        delete[] data;
+    ifstream manifest(list);
+    if (!manifest) {
+        cerr << "Cannot open the batch manifest: problems with file";
+        exit(1);
+    }
+    string line;
+    while (getline(manifest, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            inputs.push_back(line);
     }
+    return inputs;
+}
 
-private:
-    unsigned char* data;
-    int width, height, type, pixelSize = 1, size;
-};
+/// Reader -> transform -> writer pipeline: image n + 1 is read and image n - 1 written while image n is transformed.
+/// An image that cannot be read or written is reported and skipped; returns false if there were any.
+bool runBatch(const vector<string>& inputs, const char* outDir, const vector<int>& effects, ThreadPool& pool) {
+    // outputs keep the file names of their inputs, so two inputs with one name would overwrite each other
+    vector<string> outfiles;
+    unordered_map<string, const string*> owners;
+    for (const string& infile : inputs) {
+        outfiles.push_back((filesystem::path(outDir) / filesystem::path(infile).filename()).string());
+        auto owner = owners.emplace(outfiles.back(), &infile);
+        if (!owner.second) {
+            cerr << "Batch inputs " << *owner.first->second << " and " << infile << " have the same file name";
+            exit(1);
+        }
+    }
+    error_code error;
+    filesystem::create_directories(outDir, error);
+    if (!filesystem::is_directory(outDir)) {
+        cerr << "Cannot create the output directory";
+        exit(1);
+    }
+    struct Job {
+        unique_ptr<Image> image;
+        string outfile;
+    };
+    mutex reportMutex;
+    bool ok = true;
+    auto report = [&](const string& path, const char* message) {
+        lock_guard<mutex> lock(reportMutex);
+        cerr << path << ": " << message << "\n";
+        ok = false;
+    };
+    BoundedQueue<Job> toTransform(2), toWrite(2);
+    thread reader([&] {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            Job job;
+            const char* message;
+            job.image = Image::tryRead(inputs[i].c_str(), message);
+            if (job.image == nullptr) {
+                report(inputs[i], message);
+                continue;
+            }
+            job.outfile = outfiles[i];
+            toTransform.push(move(job));
+        }
+        toTransform.close();
+    });
+    thread writer([&] {
+        Job job;
+        while (toWrite.pop(job)) {
+            pnm::Status status = job.image->tryWrite(job.outfile.c_str());
+            if (status != pnm::Ok)
+                report(job.outfile, pnm::message(status));
+            job.image.reset();
+        }
+    });
+    Job job;
+    while (toTransform.pop(job)) {
+        job.image->doEffects(effects, pool);
+        toWrite.push(move(job));
+    }
+    toWrite.close();
+    reader.join();
+    writer.join();
+    return ok;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        cerr << "Incorrect arguments count; please enter your image filename, new image filename and effect number (an integer from 0 to 4)";
+    profile::parseFlag(argc, argv);
+    cpu::parseFlag(argc, argv);
+    rowKernels = selectRowKernels();
+    vector<char*> args;
+    int threads = 1;
+    bool batch = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            batch = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            try {
+                if (i + 1 == argc)
+                    throw invalid_argument("-j");
+                threads = stoi(argv[++i]);
+                if (threads < 1)
+                    throw invalid_argument("-j");
+            } catch (const exception& e) {
+                cerr << "Incorrect threads count; please enter a positive int value after -j";
+                exit(1);
+            }
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 3) {
+        if (batch)
+            cerr << "Incorrect arguments count; please enter -b, your manifest file or directory, output directory and effect numbers (integers from 0 to 4 separated by commas)";
+        else
+            cerr << "Incorrect arguments count; please enter your image filename, new image filename and effect numbers (integers from 0 to 4 separated by commas)";
         exit(1);
     }
-    Image image(argv[1]);
-    int effect;
+    vector<int> effects;
     try {
-        effect = stoi(argv[3]);
+        string list = args[2];
+        size_t pos = 0;
+        while (true) {
+            size_t comma = list.find(',', pos);
+            size_t parsed;
+            string item = list.substr(pos, comma == string::npos ? string::npos : comma - pos);
+            effects.push_back(stoi(item, &parsed));
+            if (parsed != item.size())
+                throw invalid_argument(item);
+            if (comma == string::npos)
+                break;
+            pos = comma + 1;
+        }
     } catch (const exception& e) {
-        cerr << "Incorrect effect; please enter an int value";
+        cerr << "Incorrect effect; please enter an int value or a comma-separated list of int values";
         exit(1);
     }
-    image.doEffect(effect);
-    image.write(argv[2]);
+    ThreadPool pool(threads);
+    if (batch) {
+        profile::stage("batch");
+        bool ok = runBatch(collectBatchInputs(args[0]), args[1], effects, pool);
+        profile::finish();
+        return ok ? 0 : 1;
+    }
+    profile::stage("doEffectsMapped");
+    if (Image::doEffectsMapped(args[0], args[1], effects, pool)) {
+        profile::finish();
+        return 0;
+    }
+    profile::discard();
+    profile::stage("read");
+    Image image(args[0]);
+    profile::stage("doEffects");
+    image.doEffects(effects, pool);
+    profile::stage("write");
+    image.write(args[1]);
+    profile::finish();
     return 0;
 }
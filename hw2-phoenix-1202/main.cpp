@@ -3,368 +3,1835 @@
 #include <cstring>
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <sstream>
+
+#include "../common/bounded_queue.h"
+#include "../common/cpu_dispatch.h"
+#include "../common/pnm.h"
+#include "../common/profile.h"
+#include "../common/thread_pool.h"
+
+#ifdef CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 const double eps = 1e-8;
 
-struct Image {
-public:
-    explicit Image(const char* infile) {
-        FILE* file = fopen(infile, "rb");
-        if (file == nullptr) {
-            cerr << "Cannot open the image file: problems with file";
-            exit(1);
+/// fmax(0, fmin(x, 1)) without the NaN handling of fmin/fmax (never needed here), so the loops can vectorize
+template <class T>
+inline T clamp_unit(T x) {
+    x = (x > 0) ? x : 0;
+    return (x < 1) ? x : 1;
+}
+
+/// Writes a value in 0..255 units as a sample: bytes are truncated, as by the casts of the reference code, and
+/// float samples (images of more than 8 bits) keep the value as it is
+template <class T>
+CPU_KERNEL inline void store(T value, unsigned char* out) {
+    *out = (unsigned char) value;
+}
+
+template <class T>
+CPU_KERNEL inline void store(T value, float* out) {
+    *out = (float) value;
+}
+
+/// The value store() leaves in a sample of type S, back in T
+template <class T>
+CPU_KERNEL inline T stored(T value, const unsigned char*) {
+    return (T) (unsigned char) value;
+}
+
+template <class T>
+CPU_KERNEL inline T stored(T value, const float*) {
+    return value;
+}
+
+/// A run of pixels in one of the two layouts: interleaved RGB (step 3, channels 1 sample apart) or three planes
+/// in one buffer (step 1, channels a whole plane apart), as read from and written to the three-file form.
+/// Samples are bytes, or floats in 0..255 units for images of more than 8 bits.
+template <class S>
+struct Samples {
+    S* data;  // the first channel of the first pixel
+    size_t step;
+    size_t channel;
+
+    bool planar() const {
+        return step == 1;
+    }
+
+    S* at(size_t pixel) const {
+        return data + pixel * step;
+    }
+
+    Samples from(size_t pixel) const {
+        return {at(pixel), step, channel};
+    }
+};
+
+using Pixels = Samples<unsigned char>;
+using FloatPixels = Samples<float>;
+
+/// Fixed-point engine for the linear conversions (YCbCr, YCoCg): out = floor(m * in + offset) with Q14 int16
+/// coefficients and an exact int32 accumulate, saturated to 0..255. It reproduces the truncation of the double
+/// code, and the rounded coefficients keep it within 1 LSB of it.
+
+const int linear_shift = 14;
+
+struct Linear3x3 {
+    int16_t m[3][3];
+    int32_t offset[3];
+
+    Linear3x3(const double (&a)[3][3], const double (&b)[3]) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                m[i][j] = (int16_t) lround(a[i][j] * (1 << linear_shift));
+            offset[i] = (int32_t) lround(b[i] * (1 << linear_shift));
         }
-        char f, endOfLine;
-        int w, h, maxColor, t;
-        if (fscanf(file, "%c%d%d%d%d%c", &f, &t, &w, &h, &maxColor, &endOfLine) == 6 &&
-            f == 'P' && (t == 5 || t == 6) && maxColor == 255 && endOfLine == '\n') {
-            width = w;
-            height = h;
-            type = t;
-            if (type == 6)
-                pixelSize = 3;
-            size = width * height * pixelSize;
-            data = new(nothrow) unsigned char[size];
-            if (data == nullptr) {
-                cerr << "Cannot open image file: not enough memory";
-                exit(1);
-            }
-            if (fread(data, 1, size, file) != size) {
-                cerr << "Problems with reading the image file";
-                exit(1);
-            }
-        } else {
-            cerr << "Incorrect image format: must be P5 or P6 type with maxColorValue = 255";
-            exit(1);
+    }
+};
+
+static void linear_scalar(const Pixels& src, const Pixels& dst, size_t pixels, const Linear3x3& t) {
+    for (size_t pixel = 0; pixel < pixels; pixel++) {
+        const unsigned char* p = src.at(pixel);
+        int in[3] = {p[0], p[src.channel], p[2 * src.channel]};
+        unsigned char* q = dst.at(pixel);
+        for (int i = 0; i < 3; i++) {
+            int value = (t.m[i][0] * in[0] + t.m[i][1] * in[1] + t.m[i][2] * in[2] + t.offset[i]) >> linear_shift;
+            q[i * dst.channel] = (unsigned char) min(255, max(0, value));
         }
-        fclose(file);
     }
+}
 
-    explicit Image(const char* infile_1, const char* infile_2, const char* infile_3) {
-        Image image1(infile_1);
-        Image image2(infile_2);
-        Image image3(infile_3);
-        if (image1.type == 5 && image2.type == 5 && image3.type == 5) {
-            if (image1.width == image2.width && image2.width == image3.width) {
-                if (image1.height == image2.height && image2.height == image3.height) {
-                    type = 6;
-                    pixelSize = 3;
-                    height = image1.height;
-                    width = image1.width;
-                    size = pixelSize * height * width;
-                    data = new(nothrow) unsigned char[size];
-                    if (data == nullptr) {
-                        cerr << "Cannot open image file: not enough memory";
-                        exit(1);
-                    }
-                    for (int i = 0; i < image1.size; i++) {
-                        data[i * 3] = image1.data[i];
-                        data[i * 3 + 1] = image2.data[i];
-                        data[i * 3 + 2] = image3.data[i];
-                    }
-                }
-                else {
-                    cerr << "Three input images must have the same height";
-                    exit(1);
+#ifdef CPU_DISPATCH_X86
+
+/// pshufb masks splitting 16 interleaved pixels (three 16-byte blocks) into three channel vectors and back
+struct ChannelShuffles {
+    alignas(16) unsigned char split[3][3][16];  // [channel][block]
+    alignas(16) unsigned char merge[3][3][16];  // [block][channel]
+
+    ChannelShuffles() {
+        for (int block = 0; block < 3; block++)
+            for (int c = 0; c < 3; c++)
+                for (int k = 0; k < 16; k++) {
+                    int from = 3 * k + c;
+                    split[c][block][k] = (from / 16 == block) ? from % 16 : 0x80;
+                    int to = 16 * block + k;
+                    merge[block][c][k] = (to % 3 == c) ? to / 3 : 0x80;
                 }
+    }
+};
+
+static const ChannelShuffles channel_shuffles;
+
+__attribute__((target("sse4.1")))
+static inline void split_channels(const unsigned char* src, __m128i (&channels)[3]) {
+    __m128i blocks[3];
+    for (int b = 0; b < 3; b++)
+        blocks[b] = _mm_loadu_si128((const __m128i*) (src + 16 * b));
+    for (int c = 0; c < 3; c++) {
+        const unsigned char (&mask)[3][16] = channel_shuffles.split[c];
+        channels[c] = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(blocks[0], _mm_load_si128((const __m128i*) mask[0])),
+                _mm_shuffle_epi8(blocks[1], _mm_load_si128((const __m128i*) mask[1]))),
+                _mm_shuffle_epi8(blocks[2], _mm_load_si128((const __m128i*) mask[2])));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static inline void merge_channels(const __m128i (&channels)[3], unsigned char* dst) {
+    for (int b = 0; b < 3; b++) {
+        const unsigned char (&mask)[3][16] = channel_shuffles.merge[b];
+        __m128i block = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(channels[0], _mm_load_si128((const __m128i*) mask[0])),
+                _mm_shuffle_epi8(channels[1], _mm_load_si128((const __m128i*) mask[1]))),
+                _mm_shuffle_epi8(channels[2], _mm_load_si128((const __m128i*) mask[2])));
+        _mm_storeu_si128((__m128i*) (dst + 16 * b), block);
+    }
+}
+
+/// 16 pixels as three channel vectors: shuffled out of 48 interleaved bytes, or loaded from the planes directly
+template <bool planar>
+__attribute__((target("sse4.1")))
+static inline void load_channels(const unsigned char* src, size_t channel, __m128i (&channels)[3]) {
+    if (planar) {
+        for (int c = 0; c < 3; c++)
+            channels[c] = _mm_loadu_si128((const __m128i*) (src + c * channel));
+    } else
+        split_channels(src, channels);
+}
+
+template <bool planar>
+__attribute__((target("sse4.1")))
+static inline void store_channels(const __m128i (&channels)[3], unsigned char* dst, size_t channel) {
+    if (planar) {
+        for (int c = 0; c < 3; c++)
+            _mm_storeu_si128((__m128i*) (dst + c * channel), channels[c]);
+    } else
+        merge_channels(channels, dst);
+}
+
+/// 16 pixels per iteration: channels widened to 16 bits, (r, g) and (b, 0) pairs through pmaddwd
+template <bool src_planar, bool dst_planar>
+__attribute__((target("sse4.1")))
+static void linear_sse41(const Pixels& src, const Pixels& dst, size_t pixels, const Linear3x3& t) {
+    __m128i rg_coefficients[3], b_coefficients[3], offsets[3];
+    for (int i = 0; i < 3; i++) {
+        rg_coefficients[i] = _mm_set1_epi32((int32_t) ((uint32_t) (uint16_t) t.m[i][1] << 16 | (uint16_t) t.m[i][0]));
+        b_coefficients[i] = _mm_set1_epi32((uint16_t) t.m[i][2]);
+        offsets[i] = _mm_set1_epi32(t.offset[i]);
+    }
+    __m128i zero = _mm_setzero_si128();
+    size_t pixel = 0;
+    for (; pixel + 16 <= pixels; pixel += 16) {
+        __m128i channels[3];
+        load_channels<src_planar>(src.at(pixel), src.channel, channels);
+        __m128i rg[4], b[4];
+        for (int half = 0; half < 2; half++) {
+            __m128i r16 = half ? _mm_unpackhi_epi8(channels[0], zero) : _mm_unpacklo_epi8(channels[0], zero);
+            __m128i g16 = half ? _mm_unpackhi_epi8(channels[1], zero) : _mm_unpacklo_epi8(channels[1], zero);
+            __m128i b16 = half ? _mm_unpackhi_epi8(channels[2], zero) : _mm_unpacklo_epi8(channels[2], zero);
+            rg[2 * half] = _mm_unpacklo_epi16(r16, g16);
+            rg[2 * half + 1] = _mm_unpackhi_epi16(r16, g16);
+            b[2 * half] = _mm_unpacklo_epi16(b16, zero);
+            b[2 * half + 1] = _mm_unpackhi_epi16(b16, zero);
+        }
+        __m128i out[3];
+        for (int i = 0; i < 3; i++) {
+            __m128i sums[4];
+            for (int q = 0; q < 4; q++) {
+                __m128i sum = _mm_add_epi32(_mm_madd_epi16(rg[q], rg_coefficients[i]), _mm_madd_epi16(b[q], b_coefficients[i]));
+                sums[q] = _mm_srai_epi32(_mm_add_epi32(sum, offsets[i]), linear_shift);
             }
-            else {
-                cerr << "Three input images must have the same width";
-                exit(1);
+            out[i] = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]), _mm_packs_epi32(sums[2], sums[3]));
+        }
+        store_channels<dst_planar>(out, dst.at(pixel), dst.channel);
+    }
+    linear_scalar(src.from(pixel), dst.from(pixel), pixels - pixel, t);
+}
+
+/// 32 pixels per iteration: the same shuffles on 128-bit blocks, the arithmetic on 16 pixels per register
+template <bool src_planar, bool dst_planar>
+__attribute__((target("avx2")))
+static void linear_avx2(const Pixels& src, const Pixels& dst, size_t pixels, const Linear3x3& t) {
+    __m256i rg_coefficients[3], b_coefficients[3], offsets[3];
+    for (int i = 0; i < 3; i++) {
+        rg_coefficients[i] = _mm256_set1_epi32((int32_t) ((uint32_t) (uint16_t) t.m[i][1] << 16 | (uint16_t) t.m[i][0]));
+        b_coefficients[i] = _mm256_set1_epi32((uint16_t) t.m[i][2]);
+        offsets[i] = _mm256_set1_epi32(t.offset[i]);
+    }
+    __m256i zero = _mm256_setzero_si256();
+    size_t pixel = 0;
+    for (; pixel + 32 <= pixels; pixel += 32) {
+        __m128i channels[2][3];
+        load_channels<src_planar>(src.at(pixel), src.channel, channels[0]);
+        load_channels<src_planar>(src.at(pixel + 16), src.channel, channels[1]);
+        __m256i words[2][3];
+        for (int half = 0; half < 2; half++) {
+            __m256i r16 = _mm256_cvtepu8_epi16(channels[half][0]);
+            __m256i g16 = _mm256_cvtepu8_epi16(channels[half][1]);
+            __m256i b16 = _mm256_cvtepu8_epi16(channels[half][2]);
+            // unpacklo/unpackhi work per 128-bit lane, and packs below undoes exactly that order
+            __m256i rg[2] = {_mm256_unpacklo_epi16(r16, g16), _mm256_unpackhi_epi16(r16, g16)};
+            __m256i b[2] = {_mm256_unpacklo_epi16(b16, zero), _mm256_unpackhi_epi16(b16, zero)};
+            for (int i = 0; i < 3; i++) {
+                __m256i sums[2];
+                for (int q = 0; q < 2; q++) {
+                    __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(rg[q], rg_coefficients[i]),
+                                                   _mm256_madd_epi16(b[q], b_coefficients[i]));
+                    sums[q] = _mm256_srai_epi32(_mm256_add_epi32(sum, offsets[i]), linear_shift);
+                }
+                words[half][i] = _mm256_packs_epi32(sums[0], sums[1]);
             }
+        }
+        for (int half = 0; half < 2; half++) {
+            __m128i out[3];
+            for (int i = 0; i < 3; i++)
+                out[i] = _mm_packus_epi16(_mm256_castsi256_si128(words[half][i]),
+                                          _mm256_extracti128_si256(words[half][i], 1));
+            store_channels<dst_planar>(out, dst.at(pixel + 16 * half), dst.channel);
+        }
+    }
+    linear_sse41<src_planar, dst_planar>(src.from(pixel), dst.from(pixel), pixels - pixel, t);
+}
+
+#endif
+
+template <bool src_planar, bool dst_planar>
+static void linear_layouts(const Pixels& src, const Pixels& dst, size_t pixels, const Linear3x3& t) {
+#ifdef CPU_DISPATCH_X86
+    if (cpu::level() >= cpu::AVX2) {
+        linear_avx2<src_planar, dst_planar>(src, dst, pixels, t);
+        return;
+    }
+    if (cpu::level() >= cpu::SSE41) {
+        linear_sse41<src_planar, dst_planar>(src, dst, pixels, t);
+        return;
+    }
+#endif
+    linear_scalar(src, dst, pixels, t);
+}
+
+/// dst may be src itself (in place) or a buffer in the other layout
+static void apply_linear(const Pixels& src, const Pixels& dst, size_t pixels, const Linear3x3& t) {
+    if (src.planar())
+        dst.planar() ? linear_layouts<true, true>(src, dst, pixels, t) : linear_layouts<true, false>(src, dst, pixels, t);
+    else
+        dst.planar() ? linear_layouts<false, true>(src, dst, pixels, t) : linear_layouts<false, false>(src, dst, pixels, t);
+}
+
+/// Per-pixel colorspace transforms, the reference math: decode turns the stored bytes into r, g, b in 0..255
+/// (before truncation), encode stores r, g, b given in 0..255 as bytes; the channels of a pixel are `channel`
+/// bytes apart. A pass composes two of them at compile
+/// time; X -> RGB and RGB -> Y are the plain conversions, and X -> Y runs both halves in one pass without
+/// rounding the intermediate RGB to 8 bits.
+
+struct RGB_space {
+    template <class S, class T>
+    CPU_KERNEL static void decode(const S* in, size_t channel, T& r, T& g, T& b) {
+        r = in[0];
+        g = in[channel];
+        b = in[2 * channel];
+    }
+
+    template <class T, class S>
+    CPU_KERNEL static void encode(T r, T g, T b, S* out, size_t channel) {
+        store(r, out);
+        store(g, out + channel);
+        store(b, out + 2 * channel);
+    }
+};
+
+struct HSL_space {
+    CPU_KERNEL static void decode(const unsigned char* in, size_t channel, double& r, double& g, double& b) {
+        double h = (double) in[0] / 255.0 * 360;
+        double s = (double) in[channel] / 255.0;
+        double l = (double) in[2 * channel] / 255.0;
+        double q;
+        if (0.5 - l >= eps) q = l * (s + 1);
+        else q = l + s - l * s;
+        double p = 2 * l - q;
+        double hk = h / 360;
+        double tc[3];
+        tc[0] = hk + 1.0 / 3;
+        tc[1] = hk;
+        tc[2] = hk - 1.0 / 3;
+        for (double & c : tc) {
+            if (c < 0) c += 1;
+            if (c > 1) c -= 1;
+        }
+        double rgb[3];
+        for (int j = 0; j < 3; j++) {
+            if (1.0 / 6 - tc[j] >= eps) rgb[j] = p + (q - p) * 6 * tc[j];
+            else if (1.0 / 2 - tc[j] >= eps) rgb[j] = q;
+            else if (2.0 / 3 - tc[j] >= eps) rgb[j] = p + (q - p) * 6 * (2.0 / 3 - tc[j]);
+            else rgb[j] = p;
+        }
+        r = rgb[0] * 255;
+        g = rgb[1] * 255;
+        b = rgb[2] * 255;
+    }
+
+    CPU_KERNEL static void encode(double r, double g, double b, unsigned char* out, size_t channel) {
+        r /= 255;
+        g /= 255;
+        b /= 255;
+        double mini = fmin(r, fmin(g, b));
+        double maxi = fmax(r, fmax(g, b));
+        double h;
+        if (maxi - mini < eps)
+            h = 0;
+        else if (fabs(maxi - r) < eps)
+            h = 60 * (g - b) / (maxi - mini);
+        else if (fabs(maxi - g) < eps)
+            h = 60 * (b - r) / (maxi - mini) + 120;
+        else
+            h = 60 * (r - g) / (maxi - mini) + 240;
+        if (h < 0) h += 360;
+        double s;
+        if (fabs(1 - fabs(1 - (maxi + mini))) < eps) s = 0;
+        else s = (maxi - mini) / (1 - fabs(1 - (maxi + mini)));
+        double l = 1.0 / 2 * (maxi + mini);
+        out[0] = (unsigned char) (h / 360 * 255);
+        out[channel] = (unsigned char) (s * 255);
+        out[2 * channel] = (unsigned char) (l * 255);
+    }
+};
+
+struct HSV_space {
+    CPU_KERNEL static void decode(const unsigned char* in, size_t channel, double& r, double& g, double& b) {
+        double h = (double) in[0] / 255 * 360;
+        double s = (double) in[channel] / 255 * 100;
+        double v = (double) in[2 * channel] / 255 * 100;
+        int hi = (int)(h / 60) % 6;
+        double v_min = (100 - s) * v / 100;
+        double a = (v - v_min) * ((int)h % 60) / 60;
+        double v_inc = v_min + a;
+        double v_dec = v - a;
+        switch (hi) {
+            case 0:
+                r = v;
+                g = v_inc;
+                b = v_min;
+                break;
+            case 1:
+                r = v_dec;
+                g = v;
+                b = v_min;
+                break;
+            case 2:
+                r = v_min;
+                g = v;
+                b = v_inc;
+                break;
+            case 3:
+                r = v_min;
+                g = v_dec;
+                b = v;
+                break;
+            case 4:
+                r = v_inc;
+                g = v_min;
+                b = v;
+                break;
+            default:
+                r = v;
+                g = v_min;
+                b = v_dec;
+                break;
+        }
+        r = r * 255 / 100;
+        g = g * 255 / 100;
+        b = b * 255 / 100;
+    }
+
+    CPU_KERNEL static void encode(double r, double g, double b, unsigned char* out, size_t channel) {
+        r /= 255;
+        g /= 255;
+        b /= 255;
+        double mini = fmin(r, fmin(g, b));
+        double maxi = fmax(r, fmax(g, b));
+        double h;
+        if (maxi - mini < eps)
+            h = 0;
+        else if (fabs(maxi - r) < eps)
+            h = 60 * (g - b) / (maxi - mini);
+        else if (fabs(maxi - g) < eps)
+            h = 60 * (b - r) / (maxi - mini) + 120;
+        else
+            h = 60 * (r - g) / (maxi - mini) + 240;
+        if (h < 0) h += 360;
+        double s;
+        if (maxi < eps) s = 0;
+        else s = 1 - mini / maxi;
+        double v = maxi;
+        out[0] = (unsigned char) (h / 360 * 255);
+        out[channel] = (unsigned char) (s * 255);
+        out[2 * channel] = (unsigned char) (v * 255);
+    }
+};
+
+/// Branchless HSL and HSV for -k fast: every case is computed and the result is picked with selects, so the
+/// loops vectorize (in float for the plain conversions, in double inside fused passes). The HSV hue sector and
+/// the (int) h % 60 of the reference are taken in exact integer arithmetic, which matches its truncation.
+
+template <class T>
+CPU_KERNEL inline T hsl_channel(T p, T q, T t) {
+    const T e = (T) eps;
+    t = (t < 0) ? t + 1 : t;
+    t = (t > 1) ? t - 1 : t;
+    T rising = p + (q - p) * 6 * t;
+    T falling = p + (q - p) * 6 * ((T) (2.0 / 3) - t);
+    T value = ((T) (2.0 / 3) - t >= e) ? falling : p;
+    value = ((T) 0.5 - t >= e) ? q : value;
+    return ((T) (1.0 / 6) - t >= e) ? rising : value;
+}
+
+/// Hue in sextants (0..6), 0 for grey pixels as in the reference
+template <class T>
+CPU_KERNEL inline T hue_sextant(T r, T g, T b, T maxi, T mini) {
+    T delta = maxi - mini;
+    T hue = (maxi == r) ? (g - b) / delta : ((maxi == g) ? (b - r) / delta + 2 : (r - g) / delta + 4);
+    hue = (delta > 0) ? hue : 0;
+    return (hue < 0) ? hue + 6 : hue;
+}
+
+struct HSL_branchless {
+    template <class S, class T>
+    CPU_KERNEL static void decode(const S* in, size_t channel, T& r, T& g, T& b) {
+        const T e = (T) eps;
+        T hk = in[0] * (T) (1.0 / 255);
+        T s = in[channel] * (T) (1.0 / 255);
+        T l = in[2 * channel] * (T) (1.0 / 255);
+        T q = ((T) 0.5 - l >= e) ? l * (s + 1) : l + s - l * s;
+        T p = 2 * l - q;
+        r = hsl_channel(p, q, hk + (T) (1.0 / 3)) * 255;
+        g = hsl_channel(p, q, hk) * 255;
+        b = hsl_channel(p, q, hk - (T) (1.0 / 3)) * 255;
+    }
+
+    template <class T, class S>
+    CPU_KERNEL static void encode(T r, T g, T b, S* out, size_t channel) {
+        const T e = (T) eps;
+        r *= (T) (1.0 / 255);
+        g *= (T) (1.0 / 255);
+        b *= (T) (1.0 / 255);
+        T mini = min(r, min(g, b));
+        T maxi = max(r, max(g, b));
+        T denominator = 1 - abs(1 - (maxi + mini));
+        T s = (denominator < e) ? 0 : (maxi - mini) / denominator;
+        store(hue_sextant(r, g, b, maxi, mini) * (T) (255.0 / 6), out);
+        store(s * 255, out + channel);
+        store((maxi + mini) * (T) 0.5 * 255, out + 2 * channel);
+    }
+};
+
+struct HSV_branchless {
+    template <class S, class T>
+    CPU_KERNEL static void decode(const S* in, size_t channel, T& r, T& g, T& b) {
+        int sector;
+        T offset;
+        if constexpr (is_same_v<S, unsigned char>) {
+            int degrees = in[0] * 24 / 17;  // (int) (h / 255 * 360)
+            sector = degrees / 60;
+            offset = (T) (degrees - sector * 60);
         } else {
-            cerr << "Three input images must be in pgm format (P5)";
-            exit(1);
+            // float samples keep the fraction of a degree the 8-bit reference drops
+            T degrees = in[0] * (T) (360.0 / 255);
+            sector = (int) (degrees * (T) (1.0 / 60));
+            offset = degrees - (T) (sector * 60);
         }
+        sector = (sector == 6) ? 0 : sector;
+        T s = in[channel] * (T) (100.0 / 255);
+        T v = in[2 * channel] * (T) (100.0 / 255);
+        T v_min = (100 - s) * v * (T) 0.01;
+        T a = (v - v_min) * offset * (T) (1.0 / 60);
+        T v_inc = v_min + a;
+        T v_dec = v - a;
+        r = (sector == 0 || sector == 5) ? v : ((sector == 1) ? v_dec : ((sector == 4) ? v_inc : v_min));
+        g = (sector == 1 || sector == 2) ? v : ((sector == 3) ? v_dec : ((sector == 0) ? v_inc : v_min));
+        b = (sector == 3 || sector == 4) ? v : ((sector == 5) ? v_dec : ((sector == 2) ? v_inc : v_min));
+        r *= (T) (255.0 / 100);
+        g *= (T) (255.0 / 100);
+        b *= (T) (255.0 / 100);
     }
 
-    void write(const char* outfile) {
-        FILE* file = fopen(outfile, "wb");
-        if (file == nullptr) {
-            cerr << "Cannot open the image file: problems with file";
-            exit(1);
+    template <class T, class S>
+    CPU_KERNEL static void encode(T r, T g, T b, S* out, size_t channel) {
+        const T e = (T) eps;
+        r *= (T) (1.0 / 255);
+        g *= (T) (1.0 / 255);
+        b *= (T) (1.0 / 255);
+        T mini = min(r, min(g, b));
+        T maxi = max(r, max(g, b));
+        T s = (maxi < e) ? 0 : 1 - mini / maxi;
+        store(hue_sextant(r, g, b, maxi, mini) * (T) (255.0 / 6), out);
+        store(s * 255, out + channel);
+        store(maxi * 255, out + 2 * channel);
+    }
+};
+
+struct BT601 {
+    static constexpr double kr = 0.299, kg = 0.587, kb = 0.114;
+};
+
+struct BT709 {
+    static constexpr double kr = 0.2126, kg = 0.7152, kb = 0.0722;
+};
+
+template <class K>
+struct YCbCr_space {
+    CPU_KERNEL static void decode(const unsigned char* in, size_t channel, double& r, double& g, double& b) {
+        const double kr = K::kr, kg = K::kg, kb = K::kb;
+        auto y = (double) in[0] / 255 * 219 + 16;
+        auto cb = (double) in[channel] / 255 * 224 + 16;
+        auto cr = (double) in[2 * channel] / 255 * 224 + 16;
+        double yy = (y - 16) / 219;
+        double pb = (cb - 128) / 224;
+        double pr = (cr - 128) / 224;
+        r = yy + (2 - 2 * kr) * pr;
+        g = yy + (2 * kb - 2) * kb / kg * pb + (2 * kr - 2) * kr / kg * pr;
+        b = yy + (2 - 2 * kb) * pb;
+        r = clamp_unit(r) * 255;
+        g = clamp_unit(g) * 255;
+        b = clamp_unit(b) * 255;
+    }
+
+    CPU_KERNEL static void encode(double r, double g, double b, unsigned char* out, size_t channel) {
+        const double kr = K::kr, kg = K::kg, kb = K::kb;
+        r /= 255;
+        g /= 255;
+        b /= 255;
+        double yy = kr * r + kg * g + kb * b;
+        double pb = 1.0 / 2 * (b - yy) / (1 - kb);
+        double pr = 1.0 / 2 * (r - yy) / (1 - kr);
+        double y = ((16 + yy * 219) - 16) / 219 * 255;
+        double cb = ((128 + pb * 224) - 16) / 224 * 255;
+        double cr = ((128 + pr * 224) - 16) / 224 * 255;
+        out[0] = (unsigned char) y;
+        out[channel] = (unsigned char) cb;
+        out[2 * channel] = (unsigned char) cr;
+    }
+};
+
+struct YCoCg_space {
+    CPU_KERNEL static void decode(const unsigned char* in, size_t channel, double& r, double& g, double& b) {
+        double y = (double) in[0] / 255;
+        double co = (double) in[channel] / 255 - 0.5;
+        double cg = (double) in[2 * channel] / 255 - 0.5;
+        r = clamp_unit(y + co - cg) * 255;
+        g = clamp_unit(y + cg) * 255;
+        b = clamp_unit(y - co - cg) * 255;
+    }
+
+    CPU_KERNEL static void encode(double r, double g, double b, unsigned char* out, size_t channel) {
+        r /= 255;
+        g /= 255;
+        b /= 255;
+        double y = r / 4 + g / 2 + b / 4;
+        double co = r / 2 - b / 2;
+        double cg = -r / 4 + g / 2 - b / 4;
+        out[0] = (unsigned char) (y * 255);
+        out[channel] = (unsigned char) ((co + 0.5) * 255);
+        out[2 * channel] = (unsigned char) ((cg + 0.5) * 255);
+    }
+};
+
+struct CMY_space {
+    template <class S, class T>
+    CPU_KERNEL static void decode(const S* in, size_t channel, T& r, T& g, T& b) {
+        r = 255 - in[0];
+        g = 255 - in[channel];
+        b = 255 - in[2 * channel];
+    }
+
+    /// r, g, b are stored as RGB samples first and then inverted, as the reference RGB -> CMY does
+    template <class T, class S>
+    CPU_KERNEL static void encode(T r, T g, T b, S* out, size_t channel) {
+        store(255 - stored(r, out), out);
+        store(255 - stored(g, out), out + channel);
+        store(255 - stored(b, out), out + 2 * channel);
+    }
+};
+
+const size_t pass_strip = 256;
+
+/// The halves of a pass, each compiled per layout: interleaved channels are a constant 1 byte apart, so their
+/// loads and stores vectorize as one group. The strip never overlaps the image, and saying so spares the
+/// loops their run-time alias checks.
+template <class Space, class T, size_t step, class S = unsigned char>
+static void decode_strip(const S* in, size_t channel, size_t n, T* r, T* g, T* b) {
+    cpu::run([](const S* __restrict in, size_t channel, size_t n, T* __restrict r, T* __restrict g,
+                T* __restrict b) CPU_KERNEL {
+        channel = (step == 3) ? 1 : channel;
+        for (size_t k = 0; k < n; k++)
+            Space::decode(in + k * step, channel, r[k], g[k], b[k]);
+    }, in, channel, n, r, g, b);
+}
+
+template <class Space, class T, size_t step, class S = unsigned char>
+static void encode_strip(const T* r, const T* g, const T* b, size_t n, S* out, size_t channel) {
+    cpu::run([](const T* __restrict r, const T* __restrict g, const T* __restrict b, size_t n,
+                S* __restrict out, size_t channel) CPU_KERNEL {
+        channel = (step == 3) ? 1 : channel;
+        for (size_t k = 0; k < n; k++)
+            Space::encode(r[k], g[k], b[k], out + k * step, channel);
+    }, r, g, b, n, out, channel);
+}
+
+/// The halves meet in an L1-sized strip rather than in registers: each half is then its own loop, so a
+/// branchy decode does not stop the encode after it from vectorizing. dst is src itself or a buffer in the
+/// other layout, which makes a change of layout free.
+template <class From, class To, class T = double, class S = unsigned char>
+static void pass(const Samples<S>& src, const Samples<S>& dst, size_t pixels) {
+    T r[pass_strip], g[pass_strip], b[pass_strip];
+    for (size_t start = 0; start < pixels; start += pass_strip) {
+        size_t n = min(pass_strip, pixels - start);
+        if (src.planar())
+            decode_strip<From, T, 1>(src.at(start), src.channel, n, r, g, b);
+        else
+            decode_strip<From, T, 3>(src.at(start), 1, n, r, g, b);
+        if (dst.planar())
+            encode_strip<To, T, 1>(r, g, b, n, dst.at(start), dst.channel);
+        else
+            encode_strip<To, T, 3>(r, g, b, n, dst.at(start), 1);
+    }
+}
+
+/// Fused passes use the linear spaces as matrices in 0..255 units with the divisions folded into constants;
+/// this only moves the last bits, and the fused result is not rounded to the reference bytes anyway
+template <class Space>
+struct Fused : Space {};
+
+template <class K>
+struct Fused<YCbCr_space<K>> {
+    template <class S, class T>
+    CPU_KERNEL static void decode(const S* in, size_t channel, T& r, T& g, T& b) {
+        const T kr = (T) K::kr, kg = (T) K::kg, kb = (T) K::kb;
+        T y = in[0], cb = in[channel] - (T) 127.5, cr = in[2 * channel] - (T) 127.5;
+        r = clamp_unit((y + (2 - 2 * kr) * cr) * (T) (1.0 / 255)) * 255;
+        g = clamp_unit((y + (2 * kb - 2) * kb / kg * cb + (2 * kr - 2) * kr / kg * cr) * (T) (1.0 / 255)) * 255;
+        b = clamp_unit((y + (2 - 2 * kb) * cb) * (T) (1.0 / 255)) * 255;
+    }
+
+    template <class T, class S>
+    CPU_KERNEL static void encode(T r, T g, T b, S* out, size_t channel) {
+        const T kr = (T) K::kr, kg = (T) K::kg, kb = (T) K::kb;
+        T y = kr * r + kg * g + kb * b;
+        store(y, out);
+        store((T) 127.5 + (b - y) * (1 / (2 - 2 * kb)), out + channel);
+        store((T) 127.5 + (r - y) * (1 / (2 - 2 * kr)), out + 2 * channel);
+    }
+};
+
+template <>
+struct Fused<YCoCg_space> {
+    template <class S, class T>
+    CPU_KERNEL static void decode(const S* in, size_t channel, T& r, T& g, T& b) {
+        T y = in[0], co = in[channel], cg = in[2 * channel];
+        r = clamp_unit((y + co - cg) * (T) (1.0 / 255)) * 255;
+        g = clamp_unit((y + cg - (T) 127.5) * (T) (1.0 / 255)) * 255;
+        b = clamp_unit((y - co - cg + 255) * (T) (1.0 / 255)) * 255;
+    }
+
+    template <class T, class S>
+    CPU_KERNEL static void encode(T r, T g, T b, S* out, size_t channel) {
+        store(r * (T) 0.25 + g * (T) 0.5 + b * (T) 0.25, out);
+        store((r - b) * (T) 0.5 + (T) 127.5, out + channel);
+        store((g * 2 - r - b) * (T) 0.25 + (T) 127.5, out + 2 * channel);
+    }
+};
+
+template <>
+struct Fused<HSL_space> : HSL_branchless {};
+
+template <>
+struct Fused<HSV_space> : HSV_branchless {};
+
+/// passes[from][to] for every pair of the spaces, in the order of colorspace_names, over samples of type S and
+/// computed in T
+template <class S, class T, class... Spaces>
+struct PassTable {
+    using Pass = void (*)(const Samples<S>&, const Samples<S>&, size_t);
+
+    static const int count = sizeof...(Spaces);
+
+    template <class From>
+    static constexpr array<Pass, count> row() {
+        return {pass<From, Spaces, T, S>...};
+    }
+
+    static constexpr array<Pass, count> passes[count] = {row<Spaces>()...};
+};
+
+template <class S, class T>
+using FusedSpaces = PassTable<S, T, Fused<RGB_space>, Fused<HSL_space>, Fused<HSV_space>, Fused<YCbCr_space<BT601>>,
+                              Fused<YCbCr_space<BT709>>, Fused<YCoCg_space>, Fused<CMY_space>>;
+
+using Colorspaces = FusedSpaces<unsigned char, double>;
+
+/// Images of more than 8 bits: every pair is one fused pass over float samples, never rounded in between; in
+/// float for -k fast and in double for -k reference
+template <class T>
+using WideColorspaces = FusedSpaces<float, T>;
+
+const char* const colorspace_names[Colorspaces::count] = {"RGB", "HSL", "HSV", "YCbCr.601", "YCbCr.709", "YCoCg",
+                                                          "CMY"};
+
+static int colorspace_index(const string& name) {
+    for (int i = 0; i < Colorspaces::count; i++)
+        if (name == colorspace_names[i])
+            return i;
+    return -1;
+}
+
+/// A 3D LUT: size^3 grid points with the first input channel varying fastest (the order of .cube files). For
+/// 8-bit images a grid point keeps its three outputs in one word, 10 bits each over the range of the table
+/// (value = low + q * step), so the lookup of a vertex is one gather rather than three; for images of more
+/// than 8 bits that would round away most of a sample, so wide_table keeps the outputs as floats (r, g, b per
+/// point) instead. An input value v in 0..255 lands on the grid at v * scale + offset.
+struct Lut3D {
+    int size = 0;
+    vector<uint32_t> table;
+    vector<float> wide_table;
+    float low = 0, step = 1;
+    float scale[3], offset[3];
+
+    /// Fills the table from three outputs per grid point, in 0..255 units
+    void pack(vector<float> values, bool wide) {
+        if (wide) {
+            wide_table = move(values);
+            low = 0;
+            step = 1;
+            return;
         }
-        if (fprintf(file, "P%d\n%d %d\n%d\n", type, width, height, 255) < 0 ||
-            fwrite(data, 1, size, file) != size) {
-            cerr << "Problems with writing image to outfile";
-            exit(1);
+        float high = low = values[0];
+        for (float value : values) {
+            low = min(low, value);
+            high = max(high, value);
+        }
+        step = (high > low) ? (high - low) / 1023 : 1;
+        table.resize(values.size() / 3);
+        for (size_t point = 0; point < table.size(); point++) {
+            table[point] = 0;
+            for (int c = 0; c < 3; c++)
+                table[point] |= (uint32_t) lround((values[3 * point + c] - low) / step) << (10 * c);
         }
-        fclose(file);
     }
 
-    void write(const char* outfile_1, const char* outfile_2, const char* outfile_3) {
-        FILE* file_1 = fopen(outfile_1, "wb");
-        FILE* file_2 = fopen(outfile_2, "wb");
-        FILE* file_3 = fopen(outfile_3, "wb");
-        if (file_1 == nullptr || file_2 == nullptr || file_3 == nullptr) {
-            cerr << "Cannot open one of the image file: problems with file";
+    /// .cube (Adobe/Resolve): LUT_3D_SIZE, optional DOMAIN_MIN / DOMAIN_MAX, then size^3 lines of three values
+    static Lut3D load(const char* path, bool wide) {
+        ifstream file(path);
+        if (!file) {
+            cerr << "Cannot open the LUT file: problems with file";
             exit(1);
         }
-        if (fprintf(file_1, "P%d\n%d %d\n%d\n", 5, width, height, 255) < 0 ||
-            fprintf(file_2, "P%d\n%d %d\n%d\n", 5, width, height, 255) < 0 ||
-            fprintf(file_3, "P%d\n%d %d\n%d\n", 5, width, height, 255) < 0) {
-            cerr << "Problems with writing image to one of the outfiles";
+        Lut3D lut;
+        double domain_min[3] = {0, 0, 0}, domain_max[3] = {1, 1, 1};
+        vector<float> values;
+        size_t entries = 0;
+        string line;
+        while (getline(file, line)) {
+            istringstream words(line);
+            string keyword;
+            if (!(words >> keyword) || keyword[0] == '#' || keyword == "TITLE")
+                continue;
+            bool ok = true;
+            if (keyword == "LUT_3D_SIZE") {
+                ok = (words >> lut.size) && lut.size >= 2 && lut.size <= 256 && entries == 0;
+                values.resize(3 * (size_t) lut.size * lut.size * lut.size);
+            } else if (keyword == "DOMAIN_MIN")
+                ok = (bool) (words >> domain_min[0] >> domain_min[1] >> domain_min[2]);
+            else if (keyword == "DOMAIN_MAX")
+                ok = (bool) (words >> domain_max[0] >> domain_max[1] >> domain_max[2]);
+            else if (keyword == "LUT_3D_INPUT_RANGE") {
+                ok = (bool) (words >> domain_min[0] >> domain_max[0]);
+                for (int c = 1; c < 3; c++) {
+                    domain_min[c] = domain_min[0];
+                    domain_max[c] = domain_max[0];
+                }
+            } else {
+                double value[3];
+                istringstream numbers(line);
+                ok = lut.size > 0 && 3 * entries < values.size() && (numbers >> value[0] >> value[1] >> value[2]);
+                for (int c = 0; ok && c < 3; c++)
+                    values[3 * entries + c] = (float) (value[c] * 255);
+                entries++;
+            }
+            if (!ok) {
+                cerr << "Incorrect LUT file: must be a .cube 3D LUT with LUT_3D_SIZE from 2 to 256";
+                exit(1);
+            }
+        }
+        if (lut.size == 0 || 3 * entries != values.size()) {
+            cerr << "Incorrect LUT file: must be a .cube 3D LUT with LUT_3D_SIZE from 2 to 256";
             exit(1);
         }
-        for (int i = 0; i < size; i += 3) {
-            if (fprintf(file_1, "%c", data[i]) < 0 ||
-                fprintf(file_2, "%c", data[i + 1]) < 0 ||
-                fprintf(file_3, "%c", data[i + 2]) < 0) {
-                cerr << "Problems with writing image to one of the outfiles";
+        for (int c = 0; c < 3; c++) {
+            if (domain_max[c] <= domain_min[c]) {
+                cerr << "Incorrect LUT file: DOMAIN_MAX must be above DOMAIN_MIN";
                 exit(1);
             }
+            lut.set_domain(c, domain_min[c], domain_max[c]);
         }
-        fclose(file_1);
-        fclose(file_2);
-        fclose(file_3);
+        lut.pack(move(values), wide);
+        return lut;
     }
 
-    /// Colorspace convert part
+    void set_domain(int c, double low, double high) {
+        scale[c] = (float) ((size - 1) / (255 * (high - low)));
+        offset[c] = (float) (-low * (size - 1) / (high - low));
+    }
 
-    void HSL_to_RGB() {
-        for (int i = 0; i < size; i += 3) {
-            double h = (double) data[i] / 255.0 * 360;
-            double s = (double) data[i + 1] / 255.0;
-            double l = (double) data[i + 2] / 255.0;
-            double q;
-            if (0.5 - l >= eps) q = l * (s + 1);
-            else q = l + s - l * s;
-            double p = 2 * l - q;
-            double hk = h / 360;
-            double tc[3];
-            tc[0] = hk + 1.0 / 3;
-            tc[1] = hk;
-            tc[2] = hk - 1.0 / 3;
-            for (double & c : tc) {
-                if (c < 0) c += 1;
-                if (c > 1) c -= 1;
-            }
-            double rgb[3];
-            for (int j = 0; j < 3; j++) {
-                if (1.0 / 6 - tc[j] >= eps) rgb[j] = p + (q - p) * 6 * tc[j];
-                else if (1.0 / 2 - tc[j] >= eps) rgb[j] = q;
-                else if (2.0 / 3 - tc[j] >= eps) rgb[j] = p + (q - p) * 6 * (2.0 / 3 - tc[j]);
-                else rgb[j] = p;
+    /// Tetrahedral interpolation over a strip of r, g, b in 0..255, in place. The cube cell is split into six
+    /// tetrahedra along its diagonal; which one holds the point follows from the order of the fractions and is
+    /// found without branches, so the loop vectorizes (the grid reads become gathers). bias is added to the
+    /// result: 0.5 when it is to be truncated to bytes.
+    void apply(float* r, float* g, float* b, size_t n, float bias) const {
+        if (wide_table.empty())
+            apply(r, g, b, n, table.data(), low + bias);
+        else
+            apply(r, g, b, n, wide_table.data(), bias);
+    }
+
+    /// Output c of grid point v, less low and in units of step
+    CPU_KERNEL static float grid_value(const uint32_t* table, int v, int c) {
+        return (float) (int) (table[v] >> (10 * c) & 1023);
+    }
+
+    CPU_KERNEL static float grid_value(const float* table, int v, int c) {
+        return table[3 * v + c];
+    }
+
+    template <class Entry>
+    void apply(float* r, float* g, float* b, size_t n, const Entry* table, float base) const {
+        cpu::run([](float* __restrict r, float* __restrict g, float* __restrict b, size_t n,
+                    const Entry* __restrict table, int size, float base, float step, const float* scale,
+                    const float* offset) CPU_KERNEL {
+            const float top = (float) (size - 1);
+            const int sx = 1, sy = size, sz = size * size;
+            const float scale_x = scale[0], scale_y = scale[1], scale_z = scale[2];
+            const float offset_x = offset[0], offset_y = offset[1], offset_z = offset[2];
+            for (size_t k = 0; k < n; k++) {
+                float x = r[k] * scale_x + offset_x, y = g[k] * scale_y + offset_y, z = b[k] * scale_z + offset_z;
+                x = (x > 0) ? ((x < top) ? x : top) : 0;
+                y = (y > 0) ? ((y < top) ? y : top) : 0;
+                z = (z > 0) ? ((z < top) ? z : top) : 0;
+                int ix = (int) x, iy = (int) y, iz = (int) z;
+                ix = (ix < size - 1) ? ix : size - 2;
+                iy = (iy < size - 1) ? iy : size - 2;
+                iz = (iz < size - 1) ? iz : size - 2;
+                float fx = x - (float) ix, fy = y - (float) iy, fz = z - (float) iz;
+                // the axes by decreasing fraction (ties broken as x, y, z) as 0/1 flags: arithmetic rather than
+                // chained selects, which the vectorizer would not if-convert
+                int x_max = (fx >= fy) & (fx >= fz), y_max = (1 - x_max) & (fy >= fz), z_max = 1 - x_max - y_max;
+                int z_min = (fz <= fy) & (fz <= fx), y_min = (1 - z_min) & (fy <= fx), x_min = 1 - z_min - y_min;
+                int s_max = x_max * sx + y_max * sy + z_max * sz;
+                int s_mid = sx + sy + sz - s_max - (x_min * sx + y_min * sy + z_min * sz);
+                float f_max = max(fx, max(fy, fz)), f_min = min(fx, min(fy, fz));
+                float f_mid = max(min(fx, fy), min(max(fx, fy), fz));
+                int v0 = ix + iy * sy + iz * sz, v1 = v0 + s_max, v2 = v1 + s_mid, v3 = v0 + sx + sy + sz;
+                // the weights sum to 1, so the table's low comes out once; they also carry its step
+                float w0 = (1 - f_max) * step, w1 = (f_max - f_mid) * step;
+                float w2 = (f_mid - f_min) * step, w3 = f_min * step;
+                float out_r = w0 * grid_value(table, v0, 0) + w1 * grid_value(table, v1, 0) +
+                              w2 * grid_value(table, v2, 0) + w3 * grid_value(table, v3, 0) + base;
+                float out_g = w0 * grid_value(table, v0, 1) + w1 * grid_value(table, v1, 1) +
+                              w2 * grid_value(table, v2, 1) + w3 * grid_value(table, v3, 1) + base;
+                float out_b = w0 * grid_value(table, v0, 2) + w1 * grid_value(table, v1, 2) +
+                              w2 * grid_value(table, v2, 2) + w3 * grid_value(table, v3, 2) + base;
+                r[k] = (out_r > 0) ? ((out_r < 255) ? out_r : 255) : 0;
+                g[k] = (out_g > 0) ? ((out_g < 255) ? out_g : 255) : 0;
+                b[k] = (out_b > 0) ? ((out_b < 255) ? out_b : 255) : 0;
             }
-            data[i] = (unsigned char)(rgb[0] * 255);
-            data[i + 1] = (unsigned char)(rgb[1] * 255);
-            data[i + 2] = (unsigned char)(rgb[2] * 255);
-        }
-    }
-
-    void HSV_to_RGB() {
-        for (int i = 0; i < size; i += 3) {
-            double h = (double) data[i] / 255 * 360;
-            double s = (double) data[i + 1] / 255 * 100;
-            double v = (double) data[i + 2] / 255 * 100;
-            int hi = (int)(h / 60) % 6;
-            double v_min = (100 - s) * v / 100;
-            double a = (v - v_min) * ((int)h % 60) / 60;
-            double v_inc = v_min + a;
-            double v_dec = v - a;
-            double r;
-            double g;
-            double b;
-            switch (hi) {
-                case 0:
-                    r = v;
-                    g = v_inc;
-                    b = v_min;
-                    break;
-                case 1:
-                    r = v_dec;
-                    g = v;
-                    b = v_min;
-                    break;
-                case 2:
-                    r = v_min;
-                    g = v;
-                    b = v_inc;
-                    break;
-                case 3:
-                    r = v_min;
-                    g = v_dec;
-                    b = v;
-                    break;
-                case 4:
-                    r = v_inc;
-                    g = v_min;
-                    b = v;
-                    break;
-                default:
-                    r = v;
-                    g = v_min;
-                    b = v_dec;
-                    break;
+        }, r, g, b, n, table, size, base, step, scale, offset);
+    }
+
+    /// Through the strip of a pass: samples to floats, the lookup, and back (rounded when they are bytes)
+    template <class S>
+    void apply(const Samples<S>& src, const Samples<S>& dst, size_t pixels) const {
+        float r[pass_strip], g[pass_strip], b[pass_strip];
+        for (size_t start = 0; start < pixels; start += pass_strip) {
+            size_t n = min(pass_strip, pixels - start);
+            if (src.planar())
+                decode_strip<RGB_space, float, 1>(src.at(start), src.channel, n, r, g, b);
+            else
+                decode_strip<RGB_space, float, 3>(src.at(start), 1, n, r, g, b);
+            apply(r, g, b, n, is_same_v<S, unsigned char> ? 0.5f : 0.0f);
+            if (dst.planar())
+                encode_strip<RGB_space, float, 1>(r, g, b, n, dst.at(start), dst.channel);
+            else
+                encode_strip<RGB_space, float, 3>(r, g, b, n, dst.at(start), 1);
+        }
+    }
+};
+
+/// Pixels per task of a parallel conversion: both layouts keep a chunk within L2 for the two passes of a
+/// round trip through RGB
+const size_t convert_chunk = 1 << 15;
+
+/// A conversion as given by -f, -t and -k, for any run of pixels: dst is src itself (in place) or another
+/// buffer in either layout
+struct Conversion {
+public:
+    string from_colorspace, to_colorspace;
+    bool fast = true;
+    ThreadPool* pool = nullptr;
+    const Lut3D* lut = nullptr;  // replaces the from -> to math when set
+
+    /// With a pool the run is cut into chunks converted independently; they are taken one at a time, so the
+    /// threads that get cheap regions (grey in HSL, say) take more of them
+    template <class S>
+    void apply(const Samples<S>& src, const Samples<S>& dst, size_t pixels) const {
+        size_t chunks = (pixels + convert_chunk - 1) / convert_chunk;
+        if (pool == nullptr || chunks <= 1) {
+            apply_chunk(src, dst, pixels);
+            return;
+        }
+        pool->run((int) chunks, [&](int chunk) {
+            size_t start = chunk * convert_chunk;
+            apply_chunk(src.from(start), dst.from(start), min(convert_chunk, pixels - start));
+        });
+    }
+
+    void apply_chunk(Pixels src, const Pixels& dst, size_t pixels) const {
+        if (lut != nullptr) {
+            lut->apply(src, dst, pixels);
+            return;
+        }
+        bool moved = false;
+        if (from_colorspace != to_colorspace) {
+            int from = colorspace_index(from_colorspace);
+            int to = colorspace_index(to_colorspace);
+            // neither side is RGB (index 0): one fused pass instead of a round trip through 8-bit RGB
+            if (fast && from > 0 && to > 0) {
+                Colorspaces::passes[from][to](src, dst, pixels);
+                moved = true;
+            } else {
+                if (from > 0) {
+                    if (from_colorspace == "HSL") HSL_to_RGB(src, dst, pixels);
+                    if (from_colorspace == "HSV") HSV_to_RGB(src, dst, pixels);
+                    if (from_colorspace == "YCbCr.601") YCbCr_601_to_RGB(src, dst, pixels);
+                    if (from_colorspace == "YCbCr.709") YCbCr_709_to_RGB(src, dst, pixels);
+                    if (from_colorspace == "YCoCg") YCoCg_to_RGB(src, dst, pixels);
+                    if (from_colorspace == "CMY") CMY_to_RGB(src, dst, pixels);
+                    src = dst;
+                    moved = true;
+                }
+                if (to > 0) {
+                    if (to_colorspace == "HSL") RGB_to_HSL(src, dst, pixels);
+                    if (to_colorspace == "HSV") RGB_to_HSV(src, dst, pixels);
+                    if (to_colorspace == "YCbCr.601") RGB_to_YCbCr_601(src, dst, pixels);
+                    if (to_colorspace == "YCbCr.709") RGB_to_YCbCr_709(src, dst, pixels);
+                    if (to_colorspace == "YCoCg") RGB_to_YCoCg(src, dst, pixels);
+                    if (to_colorspace == "CMY") RGB_to_CMY(src, dst, pixels);
+                    moved = true;
+                }
             }
-            data[i] = (unsigned char)(r * 255 / 100);
-            data[i + 1] = (unsigned char)(g * 255 / 100);
-            data[i + 2] = (unsigned char)(b * 255 / 100);
         }
+        if (!moved && dst.data != src.data)
+            pass<RGB_space, RGB_space, unsigned char>(src, dst, pixels);
+    }
+
+    /// Float samples go through one fused pass for every pair, RGB included, so nothing is rounded on the way
+    void apply_chunk(const FloatPixels& src, const FloatPixels& dst, size_t pixels) const {
+        if (lut != nullptr) {
+            lut->apply(src, dst, pixels);
+            return;
+        }
+        int from = colorspace_index(from_colorspace);
+        int to = colorspace_index(to_colorspace);
+        if (from >= 0 && to >= 0 && from != to)
+            (fast ? WideColorspaces<float>::passes : WideColorspaces<double>::passes)[from][to](src, dst, pixels);
+        else if (dst.data != src.data)
+            pass<RGB_space, RGB_space, float>(src, dst, pixels);
+    }
+
+    void HSL_to_RGB(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast)
+            pass<HSL_branchless, RGB_space, float>(src, dst, pixels);
+        else
+            pass<HSL_space, RGB_space>(src, dst, pixels);
+    }
+
+    void HSV_to_RGB(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast)
+            pass<HSV_branchless, RGB_space, float>(src, dst, pixels);
+        else
+            pass<HSV_space, RGB_space>(src, dst, pixels);
     }
 
-    void YCbCr_601_to_RGB() {
-        YCbCr_to_RGB(0.299, 0.587, 0.114);
+    void YCbCr_601_to_RGB(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        YCbCr_to_RGB<BT601>(src, dst, pixels);
     }
 
-    void YCbCr_709_to_RGB() {
-        YCbCr_to_RGB(0.2126, 0.7152, 0.0722);
+    void YCbCr_709_to_RGB(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        YCbCr_to_RGB<BT709>(src, dst, pixels);
     }
 
-    void YCoCg_to_RGB() {
-        for (int i = 0; i < size; i += 3) {
-            double y = (double) data[i] / 255;
-            double co = (double) data[i + 1] / 255 - 0.5;
-            double cg = (double) data[i + 2] / 255 - 0.5;
-            double r = fmin(fmax(0, y + co - cg), 1);
-            double g = fmin(fmax(0, y + cg), 1);
-            double b = fmin(fmax(0, y - co - cg), 1);
-            data[i] = (unsigned char) (r * 255);
-            data[i + 1] = (unsigned char) (g * 255);
-            data[i + 2] = (unsigned char) (b * 255);
+    void YCoCg_to_RGB(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast) {
+            const double m[3][3] = {{1, 1, -1}, {1, 0, 1}, {1, -1, -1}};
+            apply_linear(src, dst, pixels, Linear3x3(m, {0, -127.5, 255}));
+            return;
         }
+        pass<YCoCg_space, RGB_space>(src, dst, pixels);
     }
 
-    void CMY_to_RGB() {
-        inversion();
+    void CMY_to_RGB(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        inversion(src, dst, pixels);
     }
 
-    void RGB_to_HSL() {
-        for (int i = 0; i < size; i += 3) {
-            double r = (double) data[i] / 255;
-            double g = (double) data[i + 1] / 255;
-            double b = (double) data[i + 2] / 255;
-            double mini = fmin(r, fmin(g, b));
-            double maxi = fmax(r, fmax(g, b));
-            double h;
-            if (fabs(maxi - r) < eps)
-                h = 60 * (g - b) / (maxi - mini);
-            else if (fabs(maxi - g) < eps)
-                h = 60 * (b - r) / (maxi - mini) + 120;
-            else
-                h = 60 * (r - g) / (maxi - mini) + 240;
-            if (h < 0) h += 360;
-            double s;
-            if (fabs(1 - fabs(1 - (maxi + mini))) < eps) s = 0;
-            else s = (maxi - mini) / (1 - fabs(1 - (maxi + mini)));
-            double l = 1.0 / 2 * (maxi + mini);
-            data[i] = (unsigned char) (h / 360 * 255);
-            data[i + 1] = (unsigned char) (s * 255);
-            data[i + 2] = (unsigned char) (l * 255);
-        }
-    }
-
-    void RGB_to_HSV() {
-        for (int i = 0; i < size; i += 3) {
-            double r = (double) data[i] / 255;
-            double g = (double) data[i + 1] / 255;
-            double b = (double) data[i + 2] / 255;
-            double mini = fmin(r, fmin(g, b));
-            double maxi = fmax(r, fmax(g, b));
-            double h;
-            if (fabs(maxi - r) < eps)
-                h = 60 * (g - b) / (maxi - mini);
-            else if (fabs(maxi - g) < eps)
-                h = 60 * (b - r) / (maxi - mini) + 120;
-            else
-                h = 60 * (r - g) / (maxi - mini) + 240;
-            if (h < 0) h += 360;
-            double s;
-            if (maxi < eps) s = 0;
-            else s = 1 - mini / maxi;
-            double v = maxi;
-            data[i] = (unsigned char) (h / 360 * 255);
-            data[i + 1] = (unsigned char) (s * 255);
-            data[i + 2] = (unsigned char) (v * 255);
+    void RGB_to_HSL(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast)
+            pass<RGB_space, HSL_branchless, float>(src, dst, pixels);
+        else
+            pass<RGB_space, HSL_space>(src, dst, pixels);
+    }
+
+    void RGB_to_HSV(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast)
+            pass<RGB_space, HSV_branchless, float>(src, dst, pixels);
+        else
+            pass<RGB_space, HSV_space>(src, dst, pixels);
+    }
+
+    void RGB_to_YCbCr_601(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        RGB_to_YCbCr<BT601>(src, dst, pixels);
+    }
+
+    void RGB_to_YCbCr_709(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        RGB_to_YCbCr<BT709>(src, dst, pixels);
+    }
+
+    void RGB_to_YCoCg(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast) {
+            const double m[3][3] = {{0.25, 0.5, 0.25}, {0.5, 0, -0.5}, {-0.25, 0.5, -0.25}};
+            apply_linear(src, dst, pixels, Linear3x3(m, {0, 127.5, 127.5}));
+            return;
+        }
+        pass<RGB_space, YCoCg_space>(src, dst, pixels);
+    }
+
+    void RGB_to_CMY(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        inversion(src, dst, pixels);
+    }
+
+private:
+    /// Byte-wise when the layouts match: one run over interleaved pixels, or one per plane
+    void inversion(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (src.planar() != dst.planar()) {
+            pass<CMY_space, RGB_space>(src, dst, pixels);
+            return;
+        }
+        int runs = src.planar() ? 3 : 1;
+        for (int c = 0; c < runs; c++)
+            cpu::run([](const unsigned char* src, unsigned char* dst, size_t size) CPU_KERNEL {
+                for (size_t i = 0; i < size; i++)
+                    dst[i] = ~src[i];
+            }, src.data + c * src.channel, dst.data + c * dst.channel, 3 * pixels / runs);
+    }
+
+    template <class K>
+    void YCbCr_to_RGB(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast) {
+            const double kr = K::kr, kg = K::kg, kb = K::kb;
+            // in 0..255 units: r = y + (2 - 2 * kr) * (cr - 127.5) and so on
+            const double m[3][3] = {{1, 0, 2 - 2 * kr},
+                                    {1, (2 * kb - 2) * kb / kg, (2 * kr - 2) * kr / kg},
+                                    {1, 2 - 2 * kb, 0}};
+            double offset[3];
+            for (int i = 0; i < 3; i++)
+                offset[i] = -127.5 * (m[i][1] + m[i][2]);
+            apply_linear(src, dst, pixels, Linear3x3(m, offset));
+            return;
+        }
+        pass<YCbCr_space<K>, RGB_space>(src, dst, pixels);
+    }
+
+    template <class K>
+    void RGB_to_YCbCr(const Pixels& src, const Pixels& dst, size_t pixels) const {
+        if (fast) {
+            const double kr = K::kr, kg = K::kg, kb = K::kb;
+            // in 0..255 units: y = kr * r + kg * g + kb * b, cb = 127.5 + (b - y) / (2 - 2 * kb) and so on
+            const double m[3][3] = {{kr, kg, kb},
+                                    {-kr / (2 - 2 * kb), -kg / (2 - 2 * kb), 0.5},
+                                    {0.5, -kg / (2 - 2 * kr), -kb / (2 - 2 * kr)}};
+            apply_linear(src, dst, pixels, Linear3x3(m, {0, 127.5, 127.5}));
+            return;
+        }
+        pass<RGB_space, YCbCr_space<K>>(src, dst, pixels);
+    }
+};
+
+/// -c 422 / 420: the two chroma planes of a three-file image are kept at half width (422) or at half width and
+/// height (420). Chroma samples sit midway between luma samples, as in JPEG: they are decimated with the
+/// [1 3 3 1] / 8 filter along each halved axis and rebuilt with the matching 3:1 triangle filter, both clamped
+/// at the edges. A flat area survives the round trip unchanged.
+struct Subsampling {
+    bool horizontal = false, vertical = false;
+
+    size_t width(size_t full) const {
+        return horizontal ? (full + 1) / 2 : full;
+    }
+
+    size_t height(size_t full) const {
+        return vertical ? (full + 1) / 2 : full;
+    }
+};
+
+/// Only the luma-chroma spaces have planes that can be subsampled
+static bool has_chroma(const string& colorspace) {
+    return colorspace == "YCbCr.601" || colorspace == "YCbCr.709" || colorspace == "YCoCg";
+}
+
+/// sums[i] = row[2i - 1] + 3 row[2i] + 3 row[2i + 1] + row[2i + 2], eight times the decimated sample
+static void decimate_row(const unsigned char* row, size_t width, uint16_t* sums) {
+    size_t half = (width + 1) / 2;
+    // samples 1 .. end - 1 have all four taps inside the row
+    size_t end = max<size_t>(1, width >= 3 ? (width - 3) / 2 + 1 : 1);
+    cpu::run([](const unsigned char* __restrict row, uint16_t* __restrict sums, size_t end) CPU_KERNEL {
+        for (size_t i = 1; i < end; i++)
+            sums[i] = (uint16_t) (row[2 * i - 1] + 3 * (row[2 * i] + row[2 * i + 1]) + row[2 * i + 2]);
+    }, row, sums, end);
+    auto at = [&](size_t x) { return (int) row[min(x, width - 1)]; };
+    for (size_t i = 0; i < half; i = (i == 0) ? max<size_t>(1, end) : i + 1)
+        sums[i] = (uint16_t) (at(i == 0 ? 0 : 2 * i - 1) + 3 * (at(2 * i) + at(2 * i + 1)) + at(2 * i + 2));
+}
+
+/// row[2i] = 3 chroma[i] + chroma[i - 1], row[2i + 1] = 3 chroma[i] + chroma[i + 1], four times the sample
+static void interpolate_row(const unsigned char* chroma, size_t width, uint16_t* row) {
+    size_t half = (width + 1) / 2;
+    cpu::run([](const unsigned char* __restrict chroma, uint16_t* __restrict row, size_t half) CPU_KERNEL {
+        for (size_t i = 1; i + 1 < half; i++) {
+            row[2 * i] = (uint16_t) (3 * chroma[i] + chroma[i - 1]);
+            row[2 * i + 1] = (uint16_t) (3 * chroma[i] + chroma[i + 1]);
+        }
+    }, chroma, row, half);
+    for (size_t i = 0; i < half; i = (i == 0) ? max<size_t>(1, half - 1) : i + 1) {
+        row[2 * i] = (uint16_t) (3 * chroma[i] + chroma[i == 0 ? 0 : i - 1]);
+        if (2 * i + 1 < width)
+            row[2 * i + 1] = (uint16_t) (3 * chroma[i] + chroma[min(i + 1, half - 1)]);
+    }
+}
+
+/// Takes the full-size rows of a chroma plane in order and hands every finished subsampled row to emit. With
+/// 420 a row is finished once the last row under its filter has arrived, so four filtered rows are kept.
+struct ChromaDecimator {
+public:
+    ChromaDecimator(size_t width, size_t height, Subsampling subsampling, function<void(const unsigned char*)> emit)
+            : width(width), height(height), subsampling(subsampling), emit(move(emit)),
+              out(subsampling.width(width)) {
+        for (auto& sums : ring)
+            sums.resize(subsampling.width(width));
+    }
+
+    void push(const unsigned char* row) {
+        uint16_t* sums = ring[pushed % 4].data();
+        decimate_row(row, width, sums);
+        pushed++;
+        if (!subsampling.vertical) {
+            cpu::run([](const uint16_t* __restrict sums, unsigned char* __restrict out, size_t n) CPU_KERNEL {
+                for (size_t i = 0; i < n; i++)
+                    out[i] = (unsigned char) ((sums[i] + 4) >> 3);
+            }, (const uint16_t*) sums, out.data(), out.size());
+            emit(out.data());
+            return;
+        }
+        // chroma row j filters rows 2j - 1 .. 2j + 2
+        while (next < subsampling.height(height) && min(2 * next + 2, height - 1) < pushed) {
+            cpu::run([](const uint16_t* a, const uint16_t* b, const uint16_t* c, const uint16_t* d,
+                        unsigned char* __restrict out, size_t n) CPU_KERNEL {
+                for (size_t i = 0; i < n; i++)
+                    out[i] = (unsigned char) ((a[i] + 3 * (b[i] + c[i]) + d[i] + 32) >> 6);
+            }, filtered(2 * next - 1), filtered(2 * next), filtered(2 * next + 1), filtered(2 * next + 2),
+               out.data(), out.size());
+            emit(out.data());
+            next++;
         }
     }
 
-    void RGB_to_YCbCr_601() {
-        RGB_to_YCbCr(0.299, 0.587, 0.114);
+private:
+    size_t width, height;
+    Subsampling subsampling;
+    function<void(const unsigned char*)> emit;
+    vector<uint16_t> ring[4];
+    vector<unsigned char> out;
+    size_t pushed = 0, next = 0;
+
+    /// Row y after the horizontal pass, clamped to the plane
+    const uint16_t* filtered(ptrdiff_t y) const {
+        return ring[min<ptrdiff_t>(max<ptrdiff_t>(y, 0), height - 1) % 4].data();
     }
+};
 
-    void RGB_to_YCbCr_709() {
-        RGB_to_YCbCr(0.2126, 0.7152, 0.0722);
+/// Rebuilds the full-size rows of a chroma plane in order, calling read for the next subsampled row only when
+/// the filter reaches it; with 420 three interpolated rows are kept
+struct ChromaInterpolator {
+public:
+    ChromaInterpolator(size_t width, size_t height, Subsampling subsampling, function<bool(unsigned char*)> read)
+            : width(width), height(height), subsampling(subsampling), read(move(read)),
+              chroma(subsampling.width(width)) {
+        for (auto& row : ring)
+            row.resize(width);
     }
 
-    void RGB_to_YCoCg() {
-        for (int i = 0; i < size; i += 3) {
-            double r = (double) data[i] / 255;
-            double g = (double) data[i + 1] / 255;
-            double b = (double) data[i + 2] / 255;
-            double y = r / 4 + g / 2 + b / 4;
-            double co = r / 2 - b / 2;
-            double cg = -r / 4 + g / 2 - b / 4;
-            data[i] = (unsigned char) (y * 255);
-            data[i + 1] = (unsigned char) ((co + 0.5) * 255);
-            data[i + 2] = (unsigned char) ((cg + 0.5) * 255);
+    /// false when read fails
+    bool next(unsigned char* row) {
+        size_t y = produced++;
+        if (!subsampling.vertical) {
+            if (!load(0))
+                return false;
+            cpu::run([](const uint16_t* __restrict sums, unsigned char* __restrict row, size_t n) CPU_KERNEL {
+                for (size_t x = 0; x < n; x++)
+                    row[x] = (unsigned char) ((sums[x] + 2) >> 2);
+            }, (const uint16_t*) ring[0].data(), row, width);
+            return true;
         }
+        // an even row leans on the chroma row above, an odd one on the row below
+        size_t j = y / 2;
+        size_t k = (y % 2 == 0) ? (j == 0 ? 0 : j - 1) : min(j + 1, subsampling.height(height) - 1);
+        while (loaded <= max(j, k)) {
+            if (!load(loaded % 3))
+                return false;
+            loaded++;
+        }
+        cpu::run([](const uint16_t* __restrict near, const uint16_t* __restrict far, unsigned char* __restrict row,
+                    size_t n) CPU_KERNEL {
+            for (size_t x = 0; x < n; x++)
+                row[x] = (unsigned char) ((3 * near[x] + far[x] + 8) >> 4);
+        }, (const uint16_t*) ring[j % 3].data(), (const uint16_t*) ring[k % 3].data(), row, width);
+        return true;
     }
 
-    void RGB_to_CMY() {
-        inversion();
+private:
+    size_t width, height;
+    Subsampling subsampling;
+    function<bool(unsigned char*)> read;
+    vector<unsigned char> chroma;
+    vector<uint16_t> ring[3];
+    size_t produced = 0, loaded = 0;
+
+    bool load(size_t slot) {
+        if (!read(chroma.data()))
+            return false;
+        interpolate_row(chroma.data(), width, ring[slot].data());
+        return true;
+    }
+};
+
+/// Images with maxval 256..65535 (16-bit big-endian samples) are converted as floats in 0..255 units and
+/// written back with the maxval they came with
+static void load_wide(const unsigned char* raw, size_t n, int maxval, float* out) {
+    cpu::run([](const unsigned char* __restrict raw, size_t n, float scale, float* __restrict out) CPU_KERNEL {
+        for (size_t i = 0; i < n; i++)
+            out[i] = (float) (raw[2 * i] << 8 | raw[2 * i + 1]) * scale;
+    }, raw, n, (float) (255.0 / maxval), out);
+}
+
+/// Rounded to the nearest sample and clamped to maxval
+static void store_wide(const float* in, size_t n, int maxval, unsigned char* raw) {
+    cpu::run([](const float* __restrict in, size_t n, float scale, float top, unsigned char* __restrict raw)
+                     CPU_KERNEL {
+        for (size_t i = 0; i < n; i++) {
+            float value = in[i] * scale + 0.5f;
+            int sample = (int) ((value > 0) ? ((value < top) ? value : top) : 0);
+            raw[2 * i] = (unsigned char) (sample >> 8);
+            raw[2 * i + 1] = (unsigned char) sample;
+        }
+    }, in, n, (float) (maxval / 255.0), (float) maxval, raw);
+}
+
+/// Opens an input image and reads its header, with the format checks of the whole-image reader
+static FILE* open_image(const char* infile, pnm::Header& header) {
+    FILE* file = fopen(infile, "rb");
+    if (file == nullptr) {
+        cerr << pnm::message(pnm::OpenFailed);
+        exit(1);
+    }
+    if (pnm::readHeader(file, header) != pnm::Ok || header.maxval < 255) {
+        cerr << "Incorrect image format: must be P5 or P6 type with maxColorValue = 255 or from 256 to 65535";
+        exit(1);
+    }
+    return file;
+}
+
+/// Three-file input is three P5 images of the same size, or a full-size first plane with two subsampled
+/// chroma planes; returns which subsampling the plane sizes say
+static Subsampling check_planes(const pnm::Header (&headers)[3]) {
+    if (headers[0].type != 5 || headers[1].type != 5 || headers[2].type != 5) {
+        cerr << "Three input images must be in pgm format (P5)";
+        exit(1);
+    }
+    if (headers[0].maxval != headers[1].maxval || headers[1].maxval != headers[2].maxval) {
+        cerr << "Three input images must have the same maxColorValue";
+        exit(1);
+    }
+    // a plane one pixel wide is its own half, so only the height tells 4:2:0 from 4:4:4 there
+    bool half_height = headers[1].height != headers[0].height;
+    Subsampling subsampling{half_height || headers[1].width != headers[0].width, half_height};
+    if (headers[1].width != headers[2].width || (size_t) headers[1].width != subsampling.width(headers[0].width)) {
+        cerr << "Three input images must have the same width (or half of it in the last two, 4:2:2 and 4:2:0)";
+        exit(1);
+    }
+    if (headers[1].height != headers[2].height || (size_t) headers[1].height != subsampling.height(headers[0].height)) {
+        cerr << "Three input images must have the same height (or half of it in the last two, 4:2:0)";
+        exit(1);
+    }
+    return subsampling;
+}
+
+/// The chroma filters work on bytes
+static void check_chroma_depth(int maxval) {
+    if (maxval > 255) {
+        cerr << "Subsampled chroma planes are only possible for 8-bit images";
+        exit(1);
+    }
+}
+
+static void check_chroma_space(const string& colorspace) {
+    if (!has_chroma(colorspace)) {
+        cerr << "Subsampled chroma planes are only possible for YCbCr.601, YCbCr.709 and YCoCg";
+        exit(1);
+    }
+}
+
+struct Image {
+public:
+    explicit Image(const char* infile) {
+        pnm::Header header;
+        pnm::Status status = pnm::read(infile, header, data);
+        if (status == pnm::BadFormat || (status == pnm::Ok && header.maxval < 255)) {
+            cerr << "Incorrect image format: must be P5 or P6 type with maxColorValue = 255 or from 256 to 65535";
+            exit(1);
+        }
+        if (status != pnm::Ok) {
+            cerr << pnm::message(status);
+            exit(1);
+        }
+        width = header.width;
+        height = header.height;
+        type = header.type;
+        pixelSize = header.channels();
+        size = header.dataSize() / header.sampleSize();
+        maxval = header.maxval;
+        if (wide()) {
+            unsigned char* samples = allocate_samples();
+            load_wide(data, size, maxval, (float*) samples);
+            pnm::release(data);
+            data = samples;
+        }
+    }
+
+    /// The three planes are read straight into one buffer, one after another, and stay planar; subsampled
+    /// chroma planes are interpolated back to full size as they are read
+    explicit Image(const char* infile_1, const char* infile_2, const char* infile_3) {
+        const char* infiles[3] = {infile_1, infile_2, infile_3};
+        FILE* files[3];
+        pnm::Header headers[3];
+        for (int c = 0; c < 3; c++)
+            files[c] = open_image(infiles[c], headers[c]);
+        subsampling = check_planes(headers);
+        type = 6;
+        pixelSize = 3;
+        height = headers[0].height;
+        width = headers[0].width;
+        size = (size_t) pixelSize * height * width;
+        maxval = headers[0].maxval;
+        if (subsampling.horizontal)
+            check_chroma_depth(maxval);
+        planar = true;
+        data = allocate_samples();
+        size_t plane = size / 3;
+        vector<unsigned char> raw(wide() ? 2 * plane : 0);
+        for (int c = 0; c < 3; c++) {
+            bool ok = true;
+            if (wide()) {
+                ok = fread(raw.data(), 1, raw.size(), files[c]) == raw.size();
+                load_wide(raw.data(), plane, maxval, (float*) data + c * plane);
+            } else if (c == 0 || !subsampling.horizontal)
+                ok = fread(data + c * plane, 1, plane, files[c]) == plane;
+            else {
+                FILE* file = files[c];
+                size_t chroma_width = subsampling.width(width);
+                ChromaInterpolator chroma(width, height, subsampling, [file, chroma_width](unsigned char* row) {
+                    return fread(row, 1, chroma_width, file) == chroma_width;
+                });
+                for (int y = 0; y < height && ok; y++)
+                    ok = chroma.next(data + c * plane + (size_t) y * width);
+            }
+            if (!ok) {
+                cerr << pnm::message(pnm::ReadFailed);
+                exit(1);
+            }
+            fclose(files[c]);
+        }
+    }
+
+    void write(const char* outfile) {
+        set_planar(false);
+        pnm::Header header;
+        header.type = type;
+        header.width = width;
+        header.height = height;
+        pnm::Status status = write_samples(outfile, header, 0);
+        if (status == pnm::OpenFailed) {
+            cerr << "Cannot open the image file: problems with file";
+            exit(1);
+        }
+        if (status != pnm::Ok) {
+            cerr << "Problems with writing image to outfile";
+            exit(1);
+        }
+    }
+
+    /// Each plane goes out with one fwrite, or a row at a time through the decimator when it is subsampled
+    void write(const char* outfile_1, const char* outfile_2, const char* outfile_3,
+               Subsampling subsampling = Subsampling()) {
+        if (subsampling.horizontal)
+            check_chroma_depth(maxval);
+        set_planar(true);
+        const char* outfiles[3] = {outfile_1, outfile_2, outfile_3};
+        pnm::Header header;
+        header.type = 5;
+        header.width = width;
+        header.height = height;
+        for (int c = 0; c < 3; c++) {
+            pnm::Status status = (c == 0 || !subsampling.horizontal)
+                                 ? write_samples(outfiles[c], header, c * (size / 3))
+                                 : write_chroma(outfiles[c], data + c * (size / 3), subsampling);
+            if (status == pnm::OpenFailed) {
+                cerr << "Cannot open one of the image file: problems with file";
+                exit(1);
+            }
+            if (status != pnm::Ok) {
+                cerr << "Problems with writing image to one of the outfiles";
+                exit(1);
+            }
+        }
+    }
+
+    /// Colorspace convert part
+
+    void convert(const string& from_colorspace, const string& to_colorspace, ThreadPool* pool = nullptr) {
+        convert(from_colorspace, to_colorspace, planar, pool);
+    }
+
+    /// planar_output picks the layout of the result; a change of layout is done by the first pass, which then
+    /// writes into a new buffer instead of in place
+    void convert(const string& from_colorspace, const string& to_colorspace, bool planar_output,
+                 ThreadPool* pool = nullptr) {
+        convert(Conversion{from_colorspace, to_colorspace, fast, pool}, planar_output);
+    }
+
+    void convert(const Conversion& conversion, bool planar_output) {
+        unsigned char* result = (planar_output != planar) ? allocate_samples() : data;
+        if (wide())
+            conversion.apply(layout<float>(data, planar), layout<float>(result, planar_output), size / 3);
+        else
+            conversion.apply(layout<unsigned char>(data, planar), layout<unsigned char>(result, planar_output),
+                             size / 3);
+        if (result == data)
+            return;
+        pnm::release(data);
+        data = result;
+        planar = planar_output;
+    }
+
+    /// Changes the layout of the stored pixels (a no-op when it already matches)
+    void set_planar(bool value) {
+        convert("RGB", "RGB", value);
     }
 
     ~Image() {
-        delete[] data;
+        pnm::release(data);
     }
 
     int getType() const {
         return type;
     }
 
+    /// false selects the reference double code for every conversion
+    void set_fast(bool value) {
+        fast = value;
+    }
+
+    /// Whether the image was read from subsampled chroma planes
+    bool subsampled() const {
+        return subsampling.horizontal;
+    }
+
+    /// More than 8 bits per sample: data holds floats in 0..255 units rather than bytes
+    bool wide() const {
+        return maxval > 255;
+    }
+
 private:
     unsigned char* data;
-    int width, height, type, pixelSize = 1, size;
-
-    void inversion() {
-        for (int i = 0; i < size; i++)
-            data[i] = ~data[i];
-    }
-
-    void YCbCr_to_RGB(double kr, double kg, double kb) {
-        for (int i = 0; i < size; i += 3) {
-            auto y = (double) data[i] / 255 * 219 + 16;
-            auto cb = (double) data[i + 1] / 255 * 224 + 16;
-            auto cr = (double) data[i + 2] / 255 * 224 + 16;
-            double yy = (y - 16) / 219;
-            double pb = (cb - 128) / 224;
-            double pr = (cr - 128) / 224;
-            double r = yy + (2 - 2 * kr) * pr;
-            double g = yy + (2 * kb - 2) * kb / kg * pb + (2 * kr - 2) * kr / kg * pr;
-            double b = yy + (2 - 2 * kb) * pb;
-            r = fmax(fmin(r, 1), 0) * 255;
-            g = fmax(fmin(g, 1), 0) * 255;
-            b = fmax(fmin(b, 1), 0) * 255;
-            data[i] = (unsigned char) r;
-            data[i + 1] = (unsigned char) g;
-            data[i + 2] = (unsigned char) b;
-        }
-    }
-
-    void RGB_to_YCbCr(double kr, double kg, double kb) {
-        for (int i = 0; i < size; i += 3) {
-            double r = (double) data[i] / 255;
-            double g = (double) data[i + 1] / 255;
-            double b = (double) data[i + 2] / 255;
-            double yy = kr * r + kg * g + kb * b;
-            double pb = 1.0 / 2 * (b - yy) / (1 - kb);
-            double pr = 1.0 / 2 * (r - yy) / (1 - kr);
-            double y = ((16 + yy * 219) - 16) / 219 * 255;
-            double cb = ((128 + pb * 224) - 16) / 224 * 255;
-            double cr = ((128 + pr * 224) - 16) / 224 * 255;
-            data[i] = (unsigned char) y;
-            data[i + 1] = (unsigned char) cb;
-            data[i + 2] = (unsigned char) cr;
+    int width, height, type, pixelSize = 1;
+    size_t size;  // in samples
+    int maxval = 255;
+    bool fast = true;
+    bool planar = false;
+    Subsampling subsampling;
+
+    unsigned char* allocate_samples() const {
+        unsigned char* samples = pnm::allocate(size * (wide() ? sizeof(float) : 1));
+        if (samples == nullptr) {
+            cerr << pnm::message(pnm::NoMemory);
+            exit(1);
         }
+        return samples;
+    }
+
+    /// One image of the header's size from the sample at offset on, with floats rounded back to the file's maxval
+    pnm::Status write_samples(const char* outfile, pnm::Header header, size_t offset) const {
+        header.maxval = maxval;
+        if (!wide())
+            return pnm::write(outfile, header, data + offset);
+        size_t samples = header.dataSize() / 2;
+        unsigned char* raw = pnm::allocate(2 * samples);
+        if (raw == nullptr)
+            return pnm::NoMemory;
+        store_wide((const float*) data + offset, samples, maxval, raw);
+        pnm::Status status = pnm::write(outfile, header, raw);
+        pnm::release(raw);
+        return status;
+    }
+
+    pnm::Status write_chroma(const char* outfile, const unsigned char* plane, Subsampling subsampling) const {
+        FILE* file = fopen(outfile, "wb");
+        if (file == nullptr)
+            return pnm::OpenFailed;
+        pnm::Header header;
+        header.type = 5;
+        header.width = (int) subsampling.width(width);
+        header.height = (int) subsampling.height(height);
+        bool ok = pnm::writeHeader(file, header);
+        ChromaDecimator chroma(width, height, subsampling, [&](const unsigned char* row) {
+            ok = ok && fwrite(row, 1, header.width, file) == (size_t) header.width;
+        });
+        for (int y = 0; y < height; y++)
+            chroma.push(plane + (size_t) y * width);
+        ok = (fclose(file) == 0) && ok;
+        return ok ? pnm::Ok : pnm::WriteFailed;
+    }
+
+    template <class S>
+    Samples<S> layout(unsigned char* data, bool planar) const {
+        // planar: channel c of pixel k at samples[c * plane + k]
+        S* samples = (S*) data;
+        return planar ? Samples<S>{samples, 1, size / 3} : Samples<S>{samples, 3, 1};
     }
 };
 
+/// -b <size>: samples the conversion on a size^3 grid of input bytes (grid point i at round(i * 255 / (size - 1)))
+/// and keeps the results as a LUT, so every later pixel costs one interpolated lookup whatever the chain. For
+/// images of more than 8 bits the grid points are not rounded, and neither are their outputs.
+static Lut3D bake_lut(const Conversion& conversion, int size, bool wide = false) {
+    Lut3D lut;
+    lut.size = size;
+    size_t points = (size_t) size * size * size;
+    vector<float> grid(3 * points);
+    for (size_t point = 0; point < points; point++) {
+        size_t index[3] = {point % size, point / size % size, point / size / size};
+        for (int c = 0; c < 3; c++)
+            grid[3 * point + c] = (float) (wide ? index[c] * 255.0 / (size - 1) : lround(index[c] * 255.0 / (size - 1)));
+    }
+    if (wide) {
+        FloatPixels pixels = {grid.data(), 3, 1};
+        conversion.apply(pixels, pixels, points);
+    } else {
+        vector<unsigned char> bytes(grid.begin(), grid.end());
+        Pixels pixels = {bytes.data(), 3, 1};
+        conversion.apply(pixels, pixels, points);
+        grid.assign(bytes.begin(), bytes.end());
+    }
+    lut.pack(move(grid), wide);
+    for (int c = 0; c < 3; c++)
+        lut.set_domain(c, 0, 1);
+    return lut;
+}
+
+/// -s <rows>: the image goes through in strips of that many rows and is never held whole. Reading and writing
+/// run on their own threads, so strip n + 1 is read and strip n - 1 written while strip n is converted; three
+/// strips are in memory (twice that when the layout changes between input and output) for any image size.
+/// Subsampled chroma planes are resampled by the reader and the writer a row at a time, and samples of more than
+/// 8 bits are turned into floats by the reader and back by the writer.
+static void convert_stream(const vector<string>& in_file_names, const vector<string>& out_file_names,
+                           const Conversion& conversion, size_t rows, Subsampling out_subsampling) {
+    bool planar_in = in_file_names.size() == 3;
+    bool planar_out = out_file_names.size() == 3;
+    FILE* in_files[3];
+    pnm::Header headers[3];
+    for (size_t c = 0; c < in_file_names.size(); c++)
+        in_files[c] = open_image(in_file_names[c].c_str(), headers[c]);
+    Subsampling in_subsampling;
+    if (planar_in) {
+        in_subsampling = check_planes(headers);
+        if (in_subsampling.horizontal)
+            check_chroma_space(conversion.from_colorspace);
+    }
+    else if (headers[0].type == 5) {
+        cerr << "One image must be in ppm format (P6)";
+        exit(1);
+    }
+    size_t width = headers[0].width, height = headers[0].height;
+    int maxval = headers[0].maxval;
+    bool wide = maxval > 255;
+    size_t sample = headers[0].sampleSize();
+    if (in_subsampling.horizontal || out_subsampling.horizontal)
+        check_chroma_depth(maxval);
+
+    FILE* out_files[3];
+    pnm::Header header = headers[0];
+    header.type = planar_out ? 5 : 6;
+    for (size_t c = 0; c < out_file_names.size(); c++) {
+        out_files[c] = fopen(out_file_names[c].c_str(), "wb");
+        if (out_files[c] == nullptr) {
+            cerr << (planar_out ? "Cannot open one of the image file: problems with file"
+                                : "Cannot open the image file: problems with file");
+            exit(1);
+        }
+    }
+    const char* write_error = planar_out ? "Problems with writing image to one of the outfiles"
+                                         : "Problems with writing image to outfile";
+    for (size_t c = 0; c < out_file_names.size(); c++) {
+        pnm::Header plane_header = header;
+        if (c > 0) {
+            plane_header.width = (int) out_subsampling.width(width);
+            plane_header.height = (int) out_subsampling.height(height);
+        }
+        if (!pnm::writeHeader(out_files[c], plane_header)) {
+            cerr << write_error;
+            exit(1);
+        }
+    }
+    vector<ChromaInterpolator> interpolators;
+    vector<ChromaDecimator> decimators;
+    for (int c = 1; c < 3; c++) {
+        if (in_subsampling.horizontal) {
+            FILE* file = in_files[c];
+            size_t chroma_width = in_subsampling.width(width);
+            interpolators.emplace_back(width, height, in_subsampling, [file, chroma_width](unsigned char* row) {
+                return fread(row, 1, chroma_width, file) == chroma_width;
+            });
+        }
+        if (out_subsampling.horizontal) {
+            FILE* file = out_files[c];
+            size_t chroma_width = out_subsampling.width(width);
+            decimators.emplace_back(width, height, out_subsampling, [file, chroma_width, write_error](
+                    const unsigned char* row) {
+                if (fwrite(row, 1, chroma_width, file) != chroma_width) {
+                    cerr << write_error;
+                    exit(1);
+                }
+            });
+        }
+    }
+
+    rows = min(rows, height);
+    size_t capacity = rows * width;
+    bool relayout = planar_in != planar_out;
+    // in and out are the samples of the file, in_wide and out_wide their floats when they have more than 8 bits
+    struct Strip {
+        vector<unsigned char> in, out;
+        vector<float> in_wide, out_wide;
+        size_t pixels = 0;
+    };
+    vector<Strip> strips(3);
+    BoundedQueue<Strip*> free_strips(strips.size()), to_convert(1), to_write(1);
+    for (Strip& strip : strips) {
+        strip.in.resize(3 * capacity * sample);
+        if (relayout && !wide)
+            strip.out.resize(3 * capacity);
+        if (wide)
+            strip.in_wide.resize(3 * capacity);
+        if (relayout && wide)
+            strip.out_wide.resize(3 * capacity);
+        free_strips.push(&strip);
+    }
+    // a strip's planes are `capacity` samples apart, also in the last, shorter strip
+    auto layout = [capacity](auto& buffer, bool planar) {
+        using S = typename remove_reference_t<decltype(buffer)>::value_type;
+        return planar ? Samples<S>{buffer.data(), 1, capacity} : Samples<S>{buffer.data(), 3, 1};
+    };
+
+    thread reader([&] {
+        for (size_t row = 0; row < height; row += rows) {
+            Strip* strip = nullptr;
+            free_strips.pop(strip);
+            strip->pixels = min(rows, height - row) * width;
+            bool ok = true;
+            size_t bytes = strip->pixels * sample;
+            if (planar_in) {
+                ok = fread(strip->in.data(), 1, bytes, in_files[0]) == bytes;
+                for (int c = 1; c < 3; c++) {
+                    unsigned char* plane = strip->in.data() + c * capacity * sample;
+                    if (!in_subsampling.horizontal)
+                        ok = ok && fread(plane, 1, bytes, in_files[c]) == bytes;
+                    for (size_t k = 0; in_subsampling.horizontal && k < strip->pixels; k += width)
+                        ok = ok && interpolators[c - 1].next(plane + k);
+                }
+            } else
+                ok = fread(strip->in.data(), 1, 3 * bytes, in_files[0]) == 3 * bytes;
+            if (!ok) {
+                cerr << pnm::message(pnm::ReadFailed);
+                exit(1);
+            }
+            for (int c = 0; wide && c < (planar_in ? 3 : 1); c++)
+                load_wide(strip->in.data() + c * capacity * 2, planar_in ? strip->pixels : 3 * strip->pixels,
+                          maxval, strip->in_wide.data() + c * capacity);
+            to_convert.push(strip);
+        }
+        to_convert.close();
+    });
+    thread writer([&] {
+        Strip* strip;
+        while (to_write.pop(strip)) {
+            const unsigned char* out = (relayout && !wide ? strip->out : strip->in).data();
+            // the input samples are no longer needed, so the floats go back to the file's form in their place
+            const float* out_wide = (relayout ? strip->out_wide : strip->in_wide).data();
+            for (int c = 0; wide && c < (planar_out ? 3 : 1); c++)
+                store_wide(out_wide + c * capacity, planar_out ? strip->pixels : 3 * strip->pixels, maxval,
+                           strip->in.data() + c * capacity * 2);
+            size_t bytes = strip->pixels * sample;
+            bool ok = true;
+            if (planar_out) {
+                ok = fwrite(out, 1, bytes, out_files[0]) == bytes;
+                for (int c = 1; c < 3; c++) {
+                    const unsigned char* plane = out + c * capacity * sample;
+                    if (!out_subsampling.horizontal)
+                        ok = ok && fwrite(plane, 1, bytes, out_files[c]) == bytes;
+                    for (size_t k = 0; out_subsampling.horizontal && k < strip->pixels; k += width)
+                        decimators[c - 1].push(plane + k);
+                }
+            } else
+                ok = fwrite(out, 1, 3 * bytes, out_files[0]) == 3 * bytes;
+            if (!ok) {
+                cerr << write_error;
+                exit(1);
+            }
+            free_strips.push(strip);
+        }
+    });
+    Strip* strip;
+    while (to_convert.pop(strip)) {
+        if (wide)
+            conversion.apply(layout(strip->in_wide, planar_in),
+                             layout(relayout ? strip->out_wide : strip->in_wide, planar_out), strip->pixels);
+        else
+            conversion.apply(layout(strip->in, planar_in), layout(relayout ? strip->out : strip->in, planar_out),
+                             strip->pixels);
+        to_write.push(strip);
+    }
+    to_write.close();
+    reader.join();
+    writer.join();
+
+    for (size_t c = 0; c < in_file_names.size(); c++)
+        fclose(in_files[c]);
+    for (size_t c = 0; c < out_file_names.size(); c++) {
+        if (fclose(out_files[c]) != 0) {
+            cerr << write_error;
+            exit(1);
+        }
+    }
+}
+
+/// One output file is a ppm, three are pgm
+static void check_out_names(const vector<string>& out_file_names) {
+    if (out_file_names.size() == 1) {
+        if (out_file_names[0][out_file_names[0].size() - 2] != 'p') {
+            cerr << "One out file must be in ppm format (P6)";
+            exit(1);
+        }
+    }
+    else {
+        if (out_file_names[0][out_file_names[0].size() - 2] != 'g' ||
+            out_file_names[1][out_file_names[1].size() - 2] != 'g' ||
+            out_file_names[2][out_file_names[2].size() - 2] != 'g') {
+            cerr << "Three out files must be in pgm format (P5)";
+            exit(1);
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 11 && argc != 13 && argc != 15) {
-        cerr << "Incorrect arguments count, must be 11, 13 or 15";
+    profile::parseFlag(argc, argv);
+    cpu::parseFlag(argc, argv);
+    if (argc < 11 || argc > 21 || argc % 2 == 0) {
+        cerr << "Incorrect arguments count, must be 11, 13, 15, 17, 19 or 21";
         exit(1);
     }
     unordered_map<string, int> m;
@@ -378,6 +1845,12 @@ int main(int argc, char* argv[]) {
     vector<string> out_file_names;
     int in_files_cnt;
     int out_files_cnt;
+    bool fast = true;
+    size_t strip_rows = 0;
+    int threads = 1;
+    string lut_file;
+    int lut_size = 0;
+    Subsampling subsampling;
     if (m["-f"] == 1 && m["-t"] == 1 && m["-i"] == 1 && m["-o"] == 1) {
         int pos = 1;
         while (pos < argc) {
@@ -449,16 +1922,118 @@ int main(int argc, char* argv[]) {
                     exit(1);
                 }
             }
+            else if (strcmp(argv[pos], "-k") == 0) {
+                pos++;
+                if (strcmp(argv[pos], "fast") == 0)
+                    fast = true;
+                else if (strcmp(argv[pos], "reference") == 0)
+                    fast = false;
+                else {
+                    cerr << "Incorrect kernels: possible values are fast and reference";
+                    exit(1);
+                }
+                pos++;
+            }
+            else if (strcmp(argv[pos], "-s") == 0) {
+                pos++;
+                char* end = nullptr;
+                long rows = (pos < argc) ? strtol(argv[pos], &end, 10) : 0;
+                if (rows <= 0 || *end != '\0') {
+                    cerr << "Incorrect strip height: please enter a positive number of rows after -s";
+                    exit(1);
+                }
+                strip_rows = (size_t) rows;
+                pos++;
+            }
+            else if (strcmp(argv[pos], "-j") == 0) {
+                pos++;
+                char* end = nullptr;
+                long count = (pos < argc) ? strtol(argv[pos], &end, 10) : 0;
+                if (count <= 0 || *end != '\0') {
+                    cerr << "Incorrect threads count; please enter a positive int value after -j";
+                    exit(1);
+                }
+                threads = (int) count;
+                pos++;
+            }
+            else if (strcmp(argv[pos], "-l") == 0) {
+                pos++;
+                if (pos == argc || lut_size > 0) {
+                    cerr << "Incorrect LUT: give either a .cube file after -l or a size after -b";
+                    exit(1);
+                }
+                lut_file = argv[pos];
+                pos++;
+            }
+            else if (strcmp(argv[pos], "-b") == 0) {
+                pos++;
+                char* end = nullptr;
+                long size = (pos < argc) ? strtol(argv[pos], &end, 10) : 0;
+                if (size < 2 || size > 256 || *end != '\0' || !lut_file.empty()) {
+                    cerr << "Incorrect LUT size: please enter a grid size from 2 to 256 after -b";
+                    exit(1);
+                }
+                lut_size = (int) size;
+                pos++;
+            }
+            else if (strcmp(argv[pos], "-c") == 0) {
+                pos++;
+                if (pos < argc && strcmp(argv[pos], "444") == 0)
+                    subsampling = Subsampling();
+                else if (pos < argc && strcmp(argv[pos], "422") == 0)
+                    subsampling = Subsampling{true, false};
+                else if (pos < argc && strcmp(argv[pos], "420") == 0)
+                    subsampling = Subsampling{true, true};
+                else {
+                    cerr << "Incorrect chroma subsampling: possible values are 444, 422 and 420";
+                    exit(1);
+                }
+                pos++;
+            }
             else {
                 cerr << "Incorrect format of input: missed one of flags (-f, -t, -i or -o)";
                 exit(1);
             }
         }
 
+        if (subsampling.horizontal) {
+            if (out_files_cnt != 3) {
+                cerr << "Subsampled chroma needs three output files (-o 3)";
+                exit(1);
+            }
+            check_chroma_space(to_colorspace);
+        }
+
+        ThreadPool pool(threads);
+        Conversion conversion{from_colorspace, to_colorspace, fast, &pool};
+        Lut3D lut;
+        if (!lut_file.empty() || lut_size > 0) {
+            profile::stage("lut");
+            pnm::Header header;
+            fclose(open_image(in_file_names[0].c_str(), header));
+            if (lut_file.empty())
+                lut = bake_lut(conversion, lut_size, header.maxval > 255);
+            else
+                lut = Lut3D::load(lut_file.c_str(), header.maxval > 255);
+            conversion.lut = &lut;
+        }
+
+        if (strip_rows > 0) {
+            check_out_names(out_file_names);
+            profile::stage("stream");
+            convert_stream(in_file_names, out_file_names, conversion, strip_rows, subsampling);
+            profile::finish();
+            return 0;
+        }
+
         /// Read the image
+        profile::stage("read");
         Image* in_image;
-        if (in_files_cnt == 3)
+        if (in_files_cnt == 3) {
             in_image = new Image(in_file_names[0].c_str(), in_file_names[1].c_str(), in_file_names[2].c_str());
+            if (in_image->subsampled())
+                check_chroma_space(from_colorspace);
+        }
         else {
             in_image = new Image(in_file_names[0].c_str());
             if (in_image->getType() == 5) {
@@ -468,42 +2043,19 @@ int main(int argc, char* argv[]) {
         }
 
         /// Colorspace magic
-        if (from_colorspace != to_colorspace) {
-            if (from_colorspace != "RGB") {
-                if (from_colorspace == "HSL") in_image->HSL_to_RGB();
-                if (from_colorspace == "HSV") in_image->HSV_to_RGB();
-                if (from_colorspace == "YCbCr.601") in_image->YCbCr_601_to_RGB();
-                if (from_colorspace == "YCbCr.709") in_image->YCbCr_709_to_RGB();
-                if (from_colorspace == "YCoCg") in_image->YCoCg_to_RGB();
-                if (from_colorspace == "CMY") in_image->CMY_to_RGB();
-            }
-            if (to_colorspace != "RGB") {
-                if (to_colorspace == "HSL") in_image->RGB_to_HSL();
-                if (to_colorspace == "HSV") in_image->RGB_to_HSV();
-                if (to_colorspace == "YCbCr.601") in_image->RGB_to_YCbCr_601();
-                if (to_colorspace == "YCbCr.709") in_image->RGB_to_YCbCr_709();
-                if (to_colorspace == "YCoCg") in_image->RGB_to_YCoCg();
-                if (to_colorspace == "CMY") in_image->RGB_to_CMY();
-            }
-        }
+        profile::stage("convert");
+        in_image->convert(conversion, out_files_cnt == 3);
+
         /// Write the result
-        if (out_files_cnt == 1) {
-            if (out_file_names[0][out_file_names[0].size() - 2] != 'p') {
-                cerr << "One out file must be in ppm format (P6)";
-                exit(1);
-            }
+        profile::stage("write");
+        check_out_names(out_file_names);
+        if (out_files_cnt == 1)
             in_image->write(out_file_names[0].c_str());
-        }
-        else {
-            if (out_file_names[0][out_file_names[0].size() - 2] != 'g' ||
-                out_file_names[1][out_file_names[1].size() - 2] != 'g' ||
-                out_file_names[2][out_file_names[2].size() - 2] != 'g') {
-                cerr << "Three out files must be in pgm format (P5)";
-                exit(1);
-            }
-            in_image->write(out_file_names[0].c_str(), out_file_names[1].c_str(), out_file_names[2].c_str());
-        }
+        else
+            in_image->write(out_file_names[0].c_str(), out_file_names[1].c_str(), out_file_names[2].c_str(),
+                            subsampling);
         delete in_image;
+        profile::finish();
     } else {
         cerr << "Incorrect input; must be flags -f, -t, -i and -o";
         exit(1);
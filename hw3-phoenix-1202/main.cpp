@@ -3,58 +3,239 @@
 #include <cmath>
 #include <random>
 #include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <functional>
+
+#include "../common/cpu_dispatch.h"
+#include "../common/pnm.h"
+#include "../common/profile.h"
+#include "../common/thread_pool.h"
 
 using namespace std;
 
+/// Error diffusion kernels: the weights of the next two pixels of the row and of five pixels (two left to two
+/// right) of each of the two rows below, over the divisor
+struct Floyd_Steinberg {
+    static constexpr int divisor = 16;
+    static constexpr int next[2] = {7, 0};
+    static constexpr int below[2][5] = {{0, 3, 5, 1, 0}, {0, 0, 0, 0, 0}};
+};
+
+struct Jarvis_Judice_Ninke {
+    static constexpr int divisor = 48;
+    static constexpr int next[2] = {7, 5};
+    static constexpr int below[2][5] = {{3, 5, 7, 5, 3}, {1, 3, 5, 3, 1}};
+};
+
+struct Sierra_3 {
+    static constexpr int divisor = 32;
+    static constexpr int next[2] = {5, 3};
+    static constexpr int below[2][5] = {{2, 4, 5, 4, 2}, {0, 2, 3, 2, 0}};
+};
+
+struct Atkinson {
+    static constexpr int divisor = 8;
+    static constexpr int next[2] = {1, 1};
+    static constexpr int below[2][5] = {{0, 1, 1, 1, 0}, {0, 0, 1, 0, 0}};
+};
+
+/// A tileable threshold mask: cell values 0..levels - 1 are the order in which the cells turn on
+struct Mask {
+    int width = 0, height = 0, levels = 0;
+    vector<int> values;
+
+    /// Void-and-cluster (Ulichney): a random tenth of the cells is spread out by moving the tightest cluster
+    /// (most filtered neighbours among the set cells) into the largest void (fewest among the free ones) until
+    /// that stops changing anything; then these cells are ranked by taking clusters away, and the rest by
+    /// filling voids. The filter is a Gaussian wrapped around the edges, so the mask tiles without seams.
+    static Mask generate(int size) {
+        const int cells = size * size;
+        const double sigma = 1.5;
+        vector<double> filter(cells);
+        for (int dy = 0; dy < size; dy++)
+            for (int dx = 0; dx < size; dx++) {
+                int x = min(dx, size - dx), y = min(dy, size - dy);
+                filter[dy * size + dx] = exp(-(x * x + y * y) / (2 * sigma * sigma));
+            }
+        vector<char> pattern(cells, 0);
+        vector<double> energy(cells, 0);
+        auto set = [&](int cell, bool on) {
+            pattern[cell] = on;
+            int cx = cell % size, cy = cell / size;
+            double sign = on ? 1 : -1;
+            for (int y = 0; y < size; y++) {
+                const double* row = filter.data() + (y - cy + size) % size * size;
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] += sign * row[(x - cx + size) % size];
+            }
+        };
+        auto tightest_cluster = [&]() {
+            int best = 0;
+            double most = -HUGE_VAL;
+            for (int cell = 0; cell < cells; cell++)
+                if (pattern[cell] && energy[cell] > most) {
+                    best = cell;
+                    most = energy[cell];
+                }
+            return best;
+        };
+        auto largest_void = [&]() {
+            int best = 0;
+            double least = HUGE_VAL;
+            for (int cell = 0; cell < cells; cell++)
+                if (!pattern[cell] && energy[cell] < least) {
+                    best = cell;
+                    least = energy[cell];
+                }
+            return best;
+        };
+
+        // a fixed seed: the same mask every time
+        mt19937 generator(1);
+        int ones = max(1, cells / 10);
+        for (int placed = 0; placed < ones;) {
+            int cell = (int) (generator() % cells);
+            if (!pattern[cell]) {
+                set(cell, true);
+                placed++;
+            }
+        }
+        while (true) {
+            int cluster = tightest_cluster();
+            set(cluster, false);
+            int hole = largest_void();
+            set(hole, true);
+            if (hole == cluster)
+                break;
+        }
+
+        Mask mask;
+        mask.width = mask.height = size;
+        mask.levels = cells;
+        mask.values.assign(cells, 0);
+        vector<char> initial = pattern;
+        vector<double> initial_energy = energy;
+        for (int rank = ones - 1; rank >= 0; rank--) {
+            int cluster = tightest_cluster();
+            set(cluster, false);
+            mask.values[cluster] = rank;
+        }
+        pattern = initial;
+        energy = initial_energy;
+        // past half the cells the tightest cluster of free cells is the largest void as well
+        for (int rank = ones; rank < cells; rank++) {
+            int hole = largest_void();
+            set(hole, true);
+            mask.values[hole] = rank;
+        }
+        return mask;
+    }
+
+    /// The 64x64 mask, generated on first use
+    static const Mask& blue_noise() {
+        static const Mask mask = generate(64);
+        return mask;
+    }
+
+    /// Any P5 image: its samples are the cell values, maxColorValue + 1 the number of levels
+    static Mask load(const char* path) {
+        pnm::Header header;
+        unsigned char* data;
+        pnm::Status status = pnm::read(path, header, data);
+        if (status == pnm::BadFormat || (status == pnm::Ok && header.type != 5)) {
+            cerr << "Incorrect mask format: must be P5 type";
+            exit(1);
+        }
+        if (status != pnm::Ok) {
+            cerr << pnm::message(status);
+            exit(1);
+        }
+        Mask mask;
+        mask.width = header.width;
+        mask.height = header.height;
+        mask.levels = header.maxval + 1;
+        mask.values.resize((size_t) mask.width * mask.height);
+        for (size_t cell = 0; cell < mask.values.size(); cell++)
+            mask.values[cell] = (header.sampleSize() == 2) ? (int) pnm::readSample16(data + 2 * cell) : data[cell];
+        pnm::release(data);
+        return mask;
+    }
+
+    /// As P5 with 16-bit samples when there are more than 256 levels
+    void save(const char* path) const {
+        pnm::Header header;
+        header.width = width;
+        header.height = height;
+        header.maxval = levels - 1;
+        vector<unsigned char> data(header.dataSize());
+        for (size_t cell = 0; cell < values.size(); cell++) {
+            if (header.sampleSize() == 2)
+                pnm::writeSample16(data.data() + 2 * cell, values[cell]);
+            else
+                data[cell] = (unsigned char) values[cell];
+        }
+        pnm::Status status = pnm::write(path, header, data.data());
+        if (status == pnm::OpenFailed) {
+            cerr << "Cannot open the mask file: problems with file";
+            exit(1);
+        }
+        if (status != pnm::Ok) {
+            cerr << "Problems with writing mask to file";
+            exit(1);
+        }
+    }
+};
+
 struct Image {
 public:
     explicit Image(const char* infile, int grad) {
-        FILE* file = fopen(infile, "rb");
-        if (file == nullptr) {
-            cerr << "Cannot open the image file: problems with file";
+        pnm::Header header;
+        pnm::Status status;
+        if (grad == 0) {
+            status = pnm::read(infile, header, result_data);
+        } else {
+            // the gradient only needs the sizes, the raster is not read
+            FILE* file = fopen(infile, "rb");
+            status = (file == nullptr) ? pnm::OpenFailed : pnm::readHeader(file, header);
+            if (file != nullptr)
+                fclose(file);
+            if (status == pnm::Ok) {
+                result_data = pnm::allocate(header.dataSize());
+                if (result_data == nullptr)
+                    status = pnm::NoMemory;
+            }
+        }
+        if (status == pnm::BadFormat || (status == pnm::Ok && (header.type != 5 || header.maxval != 255))) {
+            cerr << "Incorrect image format: must be P5 type with maxColorValue = 255";
+            exit(1);
+        }
+        if (status != pnm::Ok) {
+            cerr << pnm::message(status);
             exit(1);
         }
-        char f, endOfLine;
-        int w, h, maxColor, t;
-        if (fscanf(file, "%c%d%d%d%d%c", &f, &t, &w, &h, &maxColor, &endOfLine) == 6 &&
-            f == 'P' && t == 5 && maxColor == 255 && endOfLine == '\n') {
-            width = w;
-            height = h;
-            size = width * height * pixelSize;
-            data = new (nothrow) double[size];
-            result_data = new (nothrow) unsigned char[size];
-            if (data == nullptr || result_data == nullptr) {
+        width = header.width;
+        height = header.height;
+        size = header.dataSize();
+        if (grad == 0) {
+            // the input is kept, so the image can be dithered again
+            data = pnm::allocate(size);
+            if (data == nullptr) {
                 cerr << "Cannot open image file: not enough memory";
                 exit(1);
             }
-            if (grad == 0) {
-                if (fread(result_data, 1, size, file) != size) {
-                    cerr << "Problems with reading the image file";
-                    exit(1);
-                }
-                for (int i = 0; i < size; i++)
-                    data[i] = (int) result_data[i];
-            } else {
-                for (int i = 0; i < height; i++)
-                    for (int j = 0; j < width; j++)
-                        data[i * width + j] = j * 255.0 / (width - 1);
-            }
-        } else {
-            cerr << "Incorrect image format: must be P5 type with maxColorValue = 255";
-            exit(1);
+            copy(result_data, result_data + size, data);
         }
-        fclose(file);
     }
 
     void no_dithering() {
-        for (int i = 0; i < size; i++) {
-            double pixel = data[i];
-            auto nearest_values = left_right(pixel);
-            double left = anti_gamma_correction(nearest_values.first / 255.0) * 255;
-            double right = anti_gamma_correction(nearest_values.second / 255.0) * 255;
-            double mid = anti_gamma_correction(pixel / 255.0) * 255;
-            result_data[i] = (unsigned char) (get_nearest(left, right, mid));
-        }
+        for (int i = 0; i < height; i++)
+            for (int j = 0; j < width; j++)
+                result_data[(size_t) i * width + j] = level(i, j).nearest;
     }
 
     void ordered_dithering() {
@@ -73,48 +254,29 @@ public:
     void random_dithering() {
         unsigned seed = chrono::system_clock::now().time_since_epoch().count();
         mt19937 generator (seed);
-        for (int i = 0; i < size; i++) {
-            double pixel = data[i];
-            auto nearest_values = left_right(pixel);
-            double left = anti_gamma_correction(nearest_values.first / 255.0) * 255;
-            double right = anti_gamma_correction(nearest_values.second / 255.0) * 255;
-            double mid = anti_gamma_correction(pixel / 255.0) * 255;
-            double delta = (double) generator() / mt19937::max() - 0.5;
-            mid += delta * (right - left);
-            result_data[i] = (unsigned char) (get_nearest(left, right, mid));
-        }
+        for (int i = 0; i < height; i++)
+            for (int j = 0; j < width; j++) {
+                const Level& pixel = level(i, j);
+                double delta = (double) generator() / mt19937::max() - 0.5;
+                double mid = pixel.mid + delta * (pixel.right - pixel.left);
+                result_data[(size_t) i * width + j] = (unsigned char) (get_nearest(pixel.left, pixel.right, mid));
+            }
     }
 
     void Floyd_Steinberg_dithering() {
-        vector<vector<double>> errors = { {7.0/16, 0.0/16},
-                                          {0.0/16, 3.0/16, 5.0/16, 1.0/16, 0.0/16},
-                                          {0.0/16, 0.0/16, 0.0/16, 0.0/16, 0.0/16}
-        };
-        error_matrix_dithering_general(errors);
+        error_diffusion<Floyd_Steinberg>();
     }
 
     void Jarvis_Judice_Ninke_dithering() {
-        vector<vector<double>> errors = { {7.0/48, 5.0/48},
-                                          {3.0/48, 5.0/48, 7.0/48, 5.0/48, 3.0/48},
-                                          {1.0/48, 3.0/48, 5.0/48, 3.0/48, 1.0/48}
-        };
-        error_matrix_dithering_general(errors);
+        error_diffusion<Jarvis_Judice_Ninke>();
     }
 
     void Sierra_3_dithering() {
-        vector<vector<double>> errors = { {5.0/32, 3.0/32},
-                                          {2.0/32, 4.0/32, 5.0/32, 4.0/32, 2.0/32},
-                                          {0.0/32, 2.0/32, 3.0/32, 2.0/32, 0.0/32}
-        };
-        error_matrix_dithering_general(errors);
+        error_diffusion<Sierra_3>();
     }
 
     void Atkinson_dithering() {
-        vector<vector<double>> errors = { {1.0/8, 1.0/8},
-                                          {0.0/8, 1.0/8, 1.0/8, 1.0/8, 0.0/8},
-                                          {0.0/8, 0.0/8, 1.0/8, 0.0/8, 0.0/8}
-        };
-        error_matrix_dithering_general(errors);
+        error_diffusion<Atkinson>();
     }
 
     void halftone_dithering() {
@@ -125,10 +287,28 @@ public:
         ordered_dithering_general(halftone_matrix, -0.5, 4);
     }
 
-    void dither(int dither, int b, double g) {
+    /// Blue-noise mask thresholds, re-centred to -0.5..0.5 cells
+    void blue_noise_dithering() {
+        const Mask& thresholds = (mask != nullptr) ? *mask : Mask::blue_noise();
+        vector<vector<double>> cells(thresholds.height, vector<double>(thresholds.width));
+        for (int i = 0; i < thresholds.height; i++)
+            for (int j = 0; j < thresholds.width; j++)
+                cells[i][j] = (thresholds.values[(size_t) i * thresholds.width + j] + 0.5) / thresholds.levels - 0.5;
+        threshold_dithering(cells);
+    }
+
+    /// The mask of blue_noise_dithering instead of the generated 64x64 one
+    void set_mask(const Mask& blue_noise_mask) {
+        mask = &blue_noise_mask;
+    }
+
+    /// With a pool error diffusion runs one row per thread, each trailing the row above
+    void dither(int dither, int b, double g, ThreadPool* threads = nullptr) {
         bits = b;
         gamma = g;
+        pool = threads;
         generate_palette();
+        generate_levels();
         switch (dither) {
             case 1:
                 ordered_dithering();
@@ -151,6 +331,9 @@ public:
             case 7:
                 halftone_dithering();
                 break;
+            case 8:
+                blue_noise_dithering();
+                break;
             default:
                 no_dithering();
                 break;
@@ -158,30 +341,58 @@ public:
     }
 
     void write(const char* outfile) {
-        FILE* file = fopen(outfile, "wb");
-        if (file == nullptr) {
+        pnm::Header header;
+        header.width = width;
+        header.height = height;
+        pnm::Status status = pnm::write(outfile, header, result_data);
+        if (status == pnm::OpenFailed) {
             cerr << "Cannot open the image file: problems with file";
             exit(1);
         }
-        if (fprintf(file, "P5\n%d %d\n%d\n", width, height, 255) < 0 ||
-            fwrite(result_data, 1, size, file) != size) {
+        if (status != pnm::Ok) {
             cerr << "Problems with writing image to outfile";
             exit(1);
         }
-        fclose(file);
     }
 
     ~Image() {
-        delete[] data;
-        delete[] result_data;
+        pnm::release(data);
+        pnm::release(result_data);
     }
 
 private:
-    double* data;
+    /// Everything the dithering needs about one input value, in 0..255 after anti-gamma correction: the
+    /// palette values around it and the value itself
+    struct Level {
+        double left, right, mid;
+        int32_t fixed_left, fixed_right, fixed_mid;  // the same in fixed point, fixed_one per unit
+        int32_t fixed_half;  // from here on right is the nearest (on a tie too)
+        unsigned char nearest;  // the result without dithering
+        unsigned char left_value, right_value;  // the results for left and right
+    };
+
+    static constexpr int fixed_one = 1 << 12;
+
+    unsigned char* data = nullptr;  // the input; none for the gradient
     unsigned char* result_data;
-    int width, height, pixelSize = 1, size, bits = 8;
+    int width, height, bits = 8;
+    size_t size;
     vector<double> palette;
     double gamma = 1;
+    vector<Level> levels;  // by input value, or by column for the gradient
+    ThreadPool* pool = nullptr;
+    const Mask* mask = nullptr;
+
+    /// Rows per task of parallel ordered dithering
+    static constexpr int ordered_band = 64;
+
+    /// Pixels of a row done between two looks at the row above in parallel error diffusion
+    static constexpr int wavefront_block = 256;
+
+    /// How far a row of parallel error diffusion is, on a cache line of its own
+    struct alignas(64) Progress {
+        atomic<int> pixels{0};
+    };
 
     void generate_palette() {
         int cnt = 1 << bits;
@@ -190,6 +401,35 @@ private:
             palette.push_back(round(255.0 / (cnt - 1) * i));
     }
 
+    /// The pow calls and palette searches are made once per distinct input value, so the modes only look up
+    /// their pixel's level: 256 of them for an image, one per column (exact) for the gradient
+    void generate_levels() {
+        vector<double> linear(palette.size());
+        for (size_t k = 0; k < palette.size(); k++)
+            linear[k] = anti_gamma_correction(palette[k] / 255.0) * 255;
+        levels.resize(data == nullptr ? width : 256);
+        for (int value = 0; value < (int) levels.size(); value++) {
+            double pixel = (data == nullptr) ? value * 255.0 / (width - 1) : value;
+            auto nearest_values = left_right(pixel);
+            Level& level = levels[value];
+            level.left = linear[nearest_values.first];
+            level.right = linear[nearest_values.second];
+            level.mid = anti_gamma_correction(pixel / 255.0) * 255;
+            level.nearest = (unsigned char) get_nearest(level.left, level.right, level.mid);
+            level.fixed_left = (int32_t) lround(level.left * fixed_one);
+            level.fixed_right = (int32_t) lround(level.right * fixed_one);
+            level.fixed_mid = (int32_t) lround(level.mid * fixed_one);
+            level.fixed_half = (level.fixed_left + level.fixed_right + 1) / 2;
+            level.left_value = (unsigned char) level.left;
+            level.right_value = (unsigned char) level.right;
+        }
+    }
+
+    const Level& level(int i, int j) const {
+        return levels[(data == nullptr) ? j : data[(size_t) i * width + j]];
+    }
+
+    /// Indices of the palette values around x
     pair<int, int> left_right(double x) {
         int l = 0;
         int r = palette.size();
@@ -201,7 +441,7 @@ private:
                 l = m;
         }
         r = min(r, (int)palette.size() - 1);
-        return make_pair(palette[l], palette[r]);
+        return make_pair(l, r);
     }
 
     static double get_nearest(double left, double right, double mid) {
@@ -220,70 +460,259 @@ private:
         for (int i = 0; i < n; i++)
             for (int j = 0; j < n; j++)
                 matrix[i][j] = (matrix[i][j] + delta) / n / n - 0.5;
-        for (int i = 0; i < height; i++)
-            for (int j = 0; j < width; j++) {
-                double pixel = data[i * width + j];
-                auto nearest_values = left_right(pixel);
-                double left = anti_gamma_correction(nearest_values.first / 255.0) * 255;
-                double right = anti_gamma_correction(nearest_values.second / 255.0) * 255;
-                double mid = anti_gamma_correction(pixel / 255.0) * 255;
-                mid += matrix[i % n][j % n] * (right - left);
-                result_data[i * width + j] = (unsigned char) (get_nearest(left, right, mid));
-            }
+        threshold_dithering(matrix);
     }
 
-    void error_matrix_dithering_general(vector<vector<double>>& errors) {
-        vector<double> error_matrix[3];
-        for (auto & i : error_matrix)
-            i.assign(width, 0);
-        for (int i = 0; i < height; i++) {
-            for (int j = 0; j < width; j++) {
-                double pixel = data[i * width + j];
-                auto nearest_values = left_right(pixel);
-                double left = anti_gamma_correction(nearest_values.first / 255.0) * 255;
-                double right = anti_gamma_correction(nearest_values.second / 255.0) * 255;
-                double mid = anti_gamma_correction(pixel / 255.0) * 255;
-                mid += error_matrix[0][j];
-                double new_pixel = get_nearest(left, right, mid);
-                double quant_error = mid - new_pixel;
-                if (j < width - 1)
-                    error_matrix[0][j + 1] += quant_error * errors[0][0];
-                if (j < width - 2)
-                    error_matrix[0][j + 2] += quant_error * errors[0][1];
-                if (i < height - 1) {
-                    if (j > 1)
-                        error_matrix[1][j - 2] += quant_error * errors[1][0];
-                    if (j > 0)
-                        error_matrix[1][j - 1] += quant_error * errors[1][1];
-                    error_matrix[1][j] += quant_error * errors[1][2];
-                    if (j < width - 1)
-                        error_matrix[1][j + 1] += quant_error * errors[1][3];
-                    if (j < width - 2)
-                        error_matrix[1][j + 2] += quant_error * errors[1][4];
-                }
-                if (i < height - 2) {
-                    if (j > 1)
-                        error_matrix[2][j - 2] += quant_error * errors[2][0];
-                    if (j > 0)
-                        error_matrix[2][j - 1] += quant_error * errors[2][1];
-                    error_matrix[2][j] += quant_error * errors[2][2];
-                    if (j < width - 1)
-                        error_matrix[2][j + 1] += quant_error * errors[2][3];
-                    if (j < width - 2)
-                        error_matrix[2][j + 2] += quant_error * errors[2][4];
+    /// A pixel's result depends only on its value and its cell of the mask (tiled over the image; the cells
+    /// are in -0.5..0.5 of the palette step), so it is found once per pair. With one bit the results of every
+    /// cell step from the low value to the high one at some input value, so a row is its pixels compared with
+    /// a row of these thresholds (the cells of its mask row tiled along it), many pixels per instruction;
+    /// otherwise each pixel looks its result up. The gradient has just as many distinct rows as the mask.
+    void threshold_dithering(const vector<vector<double>>& cells) {
+        const int rows = (int) cells.size(), columns = (int) cells[0].size();
+        auto result = [&](const Level& pixel, double cell) {
+            double mid = pixel.mid + cell * (pixel.right - pixel.left);
+            return (unsigned char) (get_nearest(pixel.left, pixel.right, mid));
+        };
+        if (data == nullptr) {
+            vector<unsigned char> pattern((size_t) rows * width);
+            for (int i = 0; i < rows; i++)
+                for (int j = 0; j < width; j++)
+                    pattern[(size_t) i * width + j] = result(levels[j], cells[i][j % columns]);
+            in_bands([&](int first, int last) {
+                for (int i = first; i < last; i++)
+                    copy_n(pattern.data() + (size_t) (i % rows) * width, width, result_data + (size_t) i * width);
+            });
+            return;
+        }
+        // by cell, then value
+        vector<unsigned char> table((size_t) rows * columns * 256);
+        for (int cell = 0; cell < rows * columns; cell++)
+            for (int value = 0; value < 256; value++)
+                table[(size_t) cell * 256 + value] = result(levels[value], cells[cell / columns][cell % columns]);
+        vector<unsigned char> cuts(rows * columns);
+        if (step_cuts(table, cuts)) {
+            vector<unsigned char> thresholds((size_t) rows * width);
+            for (int i = 0; i < rows; i++)
+                for (int j = 0; j < width; j++)
+                    thresholds[(size_t) i * width + j] = cuts[i * columns + j % columns];
+            unsigned char low = table[0], high = table[255];
+            in_bands([&](int first, int last) {
+                cpu::run([](const unsigned char* __restrict in, unsigned char* __restrict out,
+                            const unsigned char* __restrict thresholds, int width, int first, int last, int rows,
+                            unsigned char low, unsigned char high) CPU_KERNEL {
+                    for (int i = first; i < last; i++) {
+                        const unsigned char* __restrict row = in + (size_t) i * width;
+                        const unsigned char* __restrict cut = thresholds + (size_t) (i % rows) * width;
+                        unsigned char* __restrict out_row = out + (size_t) i * width;
+                        for (int j = 0; j < width; j++)
+                            out_row[j] = (row[j] >= cut[j]) ? high : low;
+                    }
+                }, data, result_data, thresholds.data(), width, first, last, rows, low, high);
+            });
+            return;
+        }
+        in_bands([&](int first, int last) {
+            for (int i = first; i < last; i++) {
+                const unsigned char* row = data + (size_t) i * width;
+                unsigned char* out_row = result_data + (size_t) i * width;
+                for (int column = 0; column < columns; column++) {
+                    const unsigned char* results = table.data() + ((size_t) (i % rows) * columns + column) * 256;
+                    for (int j = column; j < width; j += columns)
+                        out_row[j] = results[row[j]];
                 }
-                result_data[i * width + j] = (unsigned char) new_pixel;
             }
-            error_matrix[0] = error_matrix[1];
-            error_matrix[1] = error_matrix[2];
-            error_matrix[2].clear();
-            error_matrix[2].assign(width, 0);
+        });
+    }
+
+    /// Whether every cell's results (256 each) are the same low value up to some input and the same high
+    /// value from it on, and where; the top input is a palette value, so a cell's step is never past it
+    static bool step_cuts(const vector<unsigned char>& table, vector<unsigned char>& cuts) {
+        unsigned char low = table[0], high = table[255];
+        for (size_t cell = 0; cell < cuts.size(); cell++) {
+            const unsigned char* results = table.data() + cell * 256;
+            int cut = 0;
+            while (cut < 255 && results[cut] != high)
+                cut++;
+            for (int value = 0; value < 256; value++)
+                if (results[value] != ((value >= cut) ? high : low))
+                    return false;
+            cuts[cell] = (unsigned char) cut;
         }
+        return true;
+    }
+
+    /// rows(first, last) over bands of ordered_band rows, taken by the pool's threads when there is one
+    void in_bands(const function<void(int, int)>& rows) {
+        int bands = (height + ordered_band - 1) / ordered_band;
+        if (pool == nullptr) {
+            rows(0, height);
+            return;
+        }
+        pool->run(bands, [&](int band) {
+            rows(band * ordered_band, min(height, (band + 1) * ordered_band));
+        });
+    }
+
+    /// Errors are kept in fixed point and summed still multiplied by the kernel weights, so they are exact and
+    /// divided once per pixel, by a constant. The three rows of sums are a ring with padding on both sides:
+    /// taps past the edges land in the padding and are dropped, as are the rows past the bottom, without
+    /// branches. A row is the first to add to the row two below it, so it starts those sums from zero rather
+    /// than clearing the ring.
+    ///
+    /// In parallel the rows are dealt to the threads in turn, and each one trails the row above it: a block
+    /// of pixels starts once the row above is five pixels past its end (the widest kernel reaches two pixels
+    /// right in the rows below, and sums are stored two pixels behind). The arithmetic is the same as in the
+    /// serial scan, so is the result.
+    template <class Kernel>
+    void error_diffusion() {
+        const size_t stride = width + 5;
+        vector<int32_t> ring(3 * stride, 0);
+        auto row = [&](int i, auto&& sync) {
+            diffuse_row<Kernel>(levels.data(), (data == nullptr) ? nullptr : data + (size_t) i * width,
+                                result_data + (size_t) i * width, width, ring.data() + i % 3 * stride + 2,
+                                ring.data() + (i + 1) % 3 * stride + 2, ring.data() + (i + 2) % 3 * stride + 2,
+                                sync);
+        };
+        int threads = (pool == nullptr) ? 1 : min(pool->threadCount(), height);
+        if (threads <= 1) {
+            for (int i = 0; i < height; i++)
+                row(i, [](int, int) {});
+            return;
+        }
+        unique_ptr<Progress[]> progress(new Progress[height]);
+        pool->run(threads, [&](int task) {
+            for (int i = task; i < height; i += threads) {
+                row(i, [&](int done, int needed) {
+                    progress[i].pixels.store(done, memory_order_release);
+                    while (i > 0 && progress[i - 1].pixels.load(memory_order_acquire) < needed)
+                        this_thread::yield();
+                });
+                progress[i].pixels.store(width, memory_order_release);
+            }
+        });
+    }
+
+    /// Rounds down for every kernel: a shift when the divisor is a power of two; otherwise a negative sum is moved
+    /// down by divisor - 1 (a mask of its sign bit, no branch) so that the truncating division by a constant,
+    /// a multiplication by the inverse, floors as well
+    template <int divisor>
+    static int32_t divide(int32_t sum) {
+        if constexpr ((divisor & (divisor - 1)) == 0)
+            return sum >> __builtin_ctz(divisor);
+        else
+            return (sum - ((sum >> 31) & (divisor - 1))) / divisor;
+    }
+
+    /// The sums of pixels j - 2 to j + 2 of a row below, moved along the row in registers: one load and one
+    /// store per pixel instead of a read-modify-write per tap, whose overlapping accesses from pixel to pixel
+    /// would stall on store forwarding
+    template <class Kernel, int row>
+    struct Below {
+        int32_t* sums;  // at pixel j - 2
+        int32_t s0, s1, s2, s3, s4;
+
+        explicit Below(int32_t* row_sums) : sums(row_sums - 2) {
+            s0 = load(0);
+            s1 = load(1);
+            s2 = load(2);
+            s3 = load(3);
+            s4 = load(4);
+        }
+
+        /// The row two below gets its first sums here
+        int32_t load(int k) const {
+            return (row == 1) ? 0 : sums[k];
+        }
+
+        /// Adds the error of pixel j and moves on to j + 1: nothing more comes to pixel j - 2
+        void spread(int32_t error) {
+            // the weights are constants: zero ones vanish
+            s0 += error * Kernel::below[row][0];
+            s1 += error * Kernel::below[row][1];
+            s2 += error * Kernel::below[row][2];
+            s3 += error * Kernel::below[row][3];
+            s4 += error * Kernel::below[row][4];
+            *sums++ = s0;
+            s0 = s1;
+            s1 = s2;
+            s2 = s3;
+            s3 = s4;
+            s4 = load(4);
+        }
+
+        void flush() {
+            sums[0] = s0;
+            sums[1] = s1;
+            sums[2] = s2;
+            sums[3] = s3;
+            sums[4] = s4;
+        }
+    };
+
+    /// One row of the diffusion; in is null for the gradient, where the level goes by column. The sums of the
+    /// next two pixels stay in registers too: the next pixel waits on them. sync(done, needed) is called
+    /// before each block of pixels with the pixels done so far and those of the row above it needs.
+    template <class Kernel, class Sync>
+    static void diffuse_row(const Level* __restrict levels, const unsigned char* __restrict in,
+                            unsigned char* __restrict out, int width, const int32_t* __restrict current,
+                            int32_t* below_1, int32_t* below_2, Sync&& sync) {
+        sync(0, min(wavefront_block + 5, width));
+        int32_t sum_0 = current[0], sum_1 = current[1];
+        Below<Kernel, 0> row_1(below_1);
+        Below<Kernel, 1> row_2(below_2);
+        for (int start = 0; start < width; start += wavefront_block) {
+            int end = min(start + wavefront_block, width);
+            if (start > 0)
+                sync(start, min(end + 5, width));
+            for (int j = start; j < end; j++) {
+                const Level& pixel = levels[(in == nullptr) ? j : in[j]];
+                int32_t mid = pixel.fixed_mid + divide<Kernel::divisor>(sum_0);
+                // both errors and then a select, not a branch that would mispredict on every other pixel
+                int32_t right = mid >= pixel.fixed_half;
+                int32_t error_left = mid - pixel.fixed_left, error_right = mid - pixel.fixed_right;
+                int32_t error = right ? error_right : error_left;
+                out[j] = (unsigned char) (pixel.left_value + right * (pixel.right_value - pixel.left_value));
+                sum_0 = sum_1 + error * Kernel::next[0];
+                sum_1 = current[j + 2] + error * Kernel::next[1];
+                row_1.spread(error);
+                row_2.spread(error);
+            }
+        }
+        row_1.flush();
+        row_2.flush();
     }
 };
 
 int main(int argc, char* argv[]) {
-    if (argc != 7) {
+    profile::parseFlag(argc, argv);
+    cpu::parseFlag(argc, argv);
+    vector<char*> args;
+    int threads = 1;
+    const char* mask_file = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            try {
+                if (i + 1 == argc)
+                    throw invalid_argument("-j");
+                threads = stoi(argv[++i]);
+                if (threads < 1)
+                    throw invalid_argument("-j");
+            } catch (const exception& e) {
+                cerr << "Incorrect threads count; please enter a positive int value after -j";
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "-m") == 0) {
+            if (i + 1 == argc) {
+                cerr << "Incorrect mask; please enter a pgm file name after -m";
+                exit(1);
+            }
+            mask_file = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 6) {
         cerr << "Incorrect arguments count; must be 6";
         exit(1);
     }
@@ -291,17 +720,19 @@ int main(int argc, char* argv[]) {
     /// Reading or creating the image file
     int grad;
     try {
-        grad = stoi(argv[3]);
+        grad = stoi(args[2]);
     } catch (const exception& e) {
         cerr << "Incorrect gradient value; please enter 0 or 1";
         exit(1);
     }
-    Image image(argv[1], grad);
+    profile::stage("read");
+    Image image(args[0], grad);
+    profile::finish();
 
     /// Reading bits value and gamma-correction parameter
     int bits;
     try {
-        bits = stoi(argv[5]);
+        bits = stoi(args[4]);
         if (bits < 1 || bits > 8) {
             cerr << "Incorrect bits value; must be integer from 1 to 8";
             exit(1);
@@ -312,7 +743,7 @@ int main(int argc, char* argv[]) {
     }
     double gamma;
     try {
-        gamma = stod(argv[6]);
+        gamma = stod(args[5]);
     } catch (const exception& e) {
         cerr << "Incorrect gamma value; must be double";
         exit(1);
@@ -321,18 +752,38 @@ int main(int argc, char* argv[]) {
     /// Start dithering
     int dither;
     try {
-        dither = stoi(argv[4]);
-        if (dither < 0 || dither > 7) {
-            cerr << "Incorrect dither value; must be integer from 0 to 7";
+        dither = stoi(args[3]);
+        if (dither < 0 || dither > 8) {
+            cerr << "Incorrect dither value; must be integer from 0 to 8";
             exit(1);
         }
     } catch (const exception& e) {
-        cerr << "Incorrect dither value; must be integer from 0 to 7";
+        cerr << "Incorrect dither value; must be integer from 0 to 8";
         exit(1);
     }
-    image.dither(dither, bits, gamma);
+    // the mask is ready before dithering starts; a mask file that is not there yet gets the generated mask, so
+    // it is generated only once
+    Mask mask;
+    if (dither == 8) {
+        profile::stage("mask");
+        FILE* file = (mask_file != nullptr) ? fopen(mask_file, "rb") : nullptr;
+        if (file != nullptr) {
+            fclose(file);
+            mask = Mask::load(mask_file);
+        } else {
+            mask = Mask::blue_noise();
+            if (mask_file != nullptr)
+                mask.save(mask_file);
+        }
+        image.set_mask(mask);
+    }
+    ThreadPool pool(threads);
+    profile::stage("dither");
+    image.dither(dither, bits, gamma, &pool);
 
     /// Write the result to outfile
-    image.write(argv[2]);
+    profile::stage("write");
+    image.write(args[1]);
+    profile::finish();
     return 0;
 }
\ No newline at end of file
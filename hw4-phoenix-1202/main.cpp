@@ -3,6 +3,10 @@
 #include <vector>
 #include <functional>
 
+#include "../common/cpu_dispatch.h"
+#include "../common/pnm.h"
+#include "../common/profile.h"
+
 using namespace std;
 
 double B = 0, C = 0.5;
@@ -10,45 +14,30 @@ double B = 0, C = 0.5;
 struct Image {
 public:
     explicit Image(const char* infile) {
-        FILE* file = fopen(infile, "rb");
-        if (file == nullptr) {
-            cerr << "Cannot open the image file: problems with file";
+        pnm::Status status = pnm::read(infile, header, data);
+        if (status == pnm::BadFormat || (status == pnm::Ok && header.maxval != 255)) {
+            cerr << "Incorrect image format: must be P5 or P6 type with maxColorValue = 255";
             exit(1);
         }
-        char f, endOfLine;
-        int w, h, maxColor, t;
-        if (fscanf(file, "%c%d%d%d%d%c", &f, &t, &w, &h, &maxColor, &endOfLine) == 6 &&
-            f == 'P' && (t == 5 || t == 6) && maxColor == 255 && endOfLine == '\n') {
-            width = w;
-            height = h;
-            type = t;
-            pixelSize = (t == 6) ? 3 : 1;
-            size = width * height * pixelSize;
-            data = new (nothrow) unsigned char[size];
-            if (data == nullptr) {
-                cerr << "Cannot open image file: not enough memory";
-                exit(1);
-            }
-            if (fread(data, 1, size, file) != size) {
-                cerr << "Problems with reading the image file";
-                exit(1);
-            }
-        } else {
-            cerr << "Incorrect image format: must be P5 or P6 type with maxColorValue = 255";
+        if (status != pnm::Ok) {
+            cerr << pnm::message(status);
             exit(1);
         }
-        fclose(file);
+        width = header.width;
+        height = header.height;
+        pixelSize = header.channels();
+        size = header.dataSize();
     }
 
     void set_new_sizes(int w, int h) {
         newHeight = h;
         newWidth = w;
-        newData = new (nothrow) unsigned char[newHeight * newWidth * pixelSize];
+        newData = pnm::allocate((size_t) newHeight * newWidth * pixelSize);
         if (newData == nullptr) {
             cerr << "Not enough memory for write the result of effect";
             exit(1);
         }
-        fill(newData, newData + newHeight * newWidth * pixelSize, 0);
+        fill(newData, newData + (size_t) newHeight * newWidth * pixelSize, 0);
     }
 
     void set_new_params(double g, double dx, double dy) {
@@ -67,8 +56,8 @@ public:
                 for (int k = 0; k < pixelSize; k++) {
                     if (incorrect(i + (int) di, newHeight) || incorrect(j + (int) dj, newWidth))
                         continue;
-                    double x = ((double) data[(ii * width + jj) * pixelSize + k]) / 255;
-                    newData[(int) ((i + di) * newWidth + (j + dj)) * pixelSize + k] = (int) (anti_gamma_correction(x) * 255.0);
+                    double x = ((double) data[((size_t) ii * width + jj) * pixelSize + k]) / 255;
+                    newData[(size_t) ((i + di) * newWidth + (j + dj)) * pixelSize + k] = (int) (anti_gamma_correction(x) * 255.0);
                 }
             }
         }
@@ -95,29 +84,30 @@ public:
     }
 
     void write(const char* outfile) {
-        FILE* file = fopen(outfile, "wb");
-        if (file == nullptr) {
+        header.width = newWidth;
+        header.height = newHeight;
+        pnm::Status status = pnm::write(outfile, header, newData);
+        if (status == pnm::OpenFailed) {
             cerr << "Cannot open the image file: problems with file";
             exit(1);
         }
-        int newSize = newHeight * newWidth * pixelSize;
-        if (fprintf(file, "P%d\n%d %d\n%d\n", type, newWidth, newHeight, 255) < 0 ||
-            fwrite(newData, 1, newSize, file) != newSize) {
+        if (status != pnm::Ok) {
             cerr << "Problems with writing image to outfile";
             exit(1);
         }
-        fclose(file);
     }
 
     ~Image() {
-        delete[] data;
-        delete[] newData;
+        pnm::release(data);
+        pnm::release(newData);
     }
 
 private:
+    pnm::Header header;
     unsigned char* data;
     unsigned char* newData;
-    int width, height, type, pixelSize, size, newHeight, newWidth;
+    int width, height, pixelSize, newHeight, newWidth;
+    size_t size;
     double gamma, di, dj;
 
     static double L3(double x) {
@@ -154,7 +144,7 @@ private:
     }
 
     void kernel_resize(int d1_start, int d2_start, const function<double(double)>& F, bool flag) {
-        vector<double> buffer(height * newWidth * pixelSize, 0);
+        vector<double> buffer((size_t) height * newWidth * pixelSize, 0);
         /// first resize: j coordinate
         double scale_width = (double)(newWidth) / width;
         for (int i = 0; i < height; i++) {
@@ -175,50 +165,59 @@ private:
                         else
                             r = (d1 == d1_start) ? F(jj - (double) id) : F((jj - (double) id) * scale_width);
                         sum += r;
-                        double x = data[(i * width + min(max(0, id), width - 1)) * pixelSize + k];
+                        double x = data[((size_t) i * width + min(max(0, id), width - 1)) * pixelSize + k];
                         res += anti_gamma_correction(x / 255.0) * 255 * r;
                     }
-                    buffer[(i * newWidth + j) * pixelSize + k] = res / sum;
+                    buffer[((size_t) i * newWidth + j) * pixelSize + k] = res / sum;
                 }
             }
         }
         /// second resize: i coordinate
         double scale_height = (double)(newHeight) / height;
+        size_t row_size = (size_t) newWidth * pixelSize;
+        vector<double> row(row_size);
         for (int i = 0; i < newHeight; i++) {
+            double ii = (double) i / scale_height;
+            int d1 = d1_start, d2 = d2_start;
+            if (height > newHeight) {
+                d1 = (int) (d1 / scale_height);
+                d2 = (int) (d2 / scale_height);
+            }
+            // the weights depend on i only, so every tap is accumulated over the whole row at once
+            fill(row.begin(), row.end(), 0);
+            double sum = 0;
+            for (int id = (int) ii - d1; id <= (int) ii + d2; id++) {
+                double r;
+                if (flag)
+                    r = (d1 == d1_start) ? F(ii - (double) id) : F((ii - (double) id) * scale_height / (d2 - d1)) * (d2 - d1);
+                else
+                    r = (d1 == d1_start) ? F(ii - (double) id) : F((ii - (double) id) * scale_height);
+                sum += r;
+                cpu::run([](double* res, const double* src, size_t n, double r) CPU_KERNEL {
+                    for (size_t x = 0; x < n; x++)
+                        res[x] += src[x] * r;
+                }, row.data(), buffer.data() + (size_t) min(max(0, id), height - 1) * row_size, row_size, r);
+            }
             for (int j = 0; j < newWidth; j++) {
                 if (incorrect(i + (int) di, newHeight) || incorrect(j + (int) dj, newWidth))
                     continue;
-                double ii = (double) i / scale_height;
-                int d1 = d1_start, d2 = d2_start;
-                if (height > newHeight) {
-                    d1 = (int) (d1 / scale_height);
-                    d2 = (int) (d2 / scale_height);
-                }
-                for (int k = 0; k < pixelSize; k++) {
-                    double res = 0;
-                    double sum = 0;
-                    for (int id = (int) ii - d1; id <= (int) ii + d2; id++) {
-                        double r;
-                        if (flag)
-                            r = (d1 == d1_start) ? F(ii - (double) id) : F((ii - (double) id) * scale_height / (d2 - d1)) * (d2 - d1);
-                        else
-                            r = (d1 == d1_start) ? F(ii - (double) id) : F((ii - (double) id) * scale_height);
-                        sum += r;
-                        res += buffer[(min(max(0, id), height - 1) * newWidth + j) * pixelSize + k] * r;
-                    }
-                    newData[(int)((i + di) * newWidth + j + dj) * pixelSize + k] = (unsigned char) fmin(255, fmax(0, res / sum));
-                }
+                for (int k = 0; k < pixelSize; k++)
+                    newData[(size_t) ((i + di) * newWidth + j + dj) * pixelSize + k] = (unsigned char) fmin(255, fmax(0, row[(size_t) j * pixelSize + k] / sum));
             }
         }
     }
 };
 
 int main(int argc, char* argv[]) {
+    profile::parseFlag(argc, argv);
+    cpu::parseFlag(argc, argv);
     if (argc != 9 && argc != 11) {
         cerr << "Incorrect arguments count; expected 8, 9 or 10";
         exit(1);
     }
+    profile::stage("read");
     Image image(argv[1]);
+    profile::finish();
 
     /// New sizes
     int new_width;
@@ -275,7 +274,10 @@ int main(int argc, char* argv[]) {
     }
 
     /// Doing the algorithm and writing the result
+    profile::stage("do_algorithm");
     image.do_algorithm(algorithm);
+    profile::stage("write");
     image.write(argv[2]);
+    profile::finish();
     return 0;
 }
@@ -1,39 +1,26 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+
+#include "../common/pnm.h"
+#include "../common/profile.h"
 
 using namespace std;
 
 struct Image {
 public:
     explicit Image(const char* infile) {
-        FILE* file = fopen(infile, "rb");
-        if (file == nullptr) {
-            cerr << "Cannot open the image file: problems with file";
+        pnm::Status status = pnm::read(infile, header, data);
+        if (status == pnm::BadFormat || (status == pnm::Ok && (header.type != 5 || header.maxval != 255))) {
+            cerr << "Incorrect image format: must be P5 type with maxColorValue = 255";
             exit(1);
         }
-        char f, endOfLine;
-        int w, h, maxColor, t;
-        if (fscanf(file, "%c%d%d%d%d%c", &f, &t, &w, &h, &maxColor, &endOfLine) == 6 &&
-            f == 'P' && t == 5 && maxColor == 255 && endOfLine == '\n') {
-            width = w;
-            height = h;
-            type = t;
-            size = width * height * pixelSize;
-            data = new (nothrow) unsigned char[size];
-            if (data == nullptr) {
-                cerr << "Cannot open image file: not enough memory";
-                exit(1);
-            }
-            if (fread(data, 1, size, file) != size) {
-                cerr << "Problems with reading the image file";
-                exit(1);
-            }
-        } else {
-            cerr << "Incorrect image format: must be P5 or P6 type with maxColorValue = 255";
+        if (status != pnm::Ok) {
+            cerr << pnm::message(status);
             exit(1);
         }
-        fclose(file);
+        size = header.dataSize();
     }
 
     void multi_Otsu_tresholding(int delimiters) {
@@ -78,7 +65,7 @@ public:
                 f[i] = f[i - 1] + 1;
         }
         // write new colors
-        for (int i = 0; i < size; i++) {
+        for (size_t i = 0; i < size; i++) {
             unsigned char new_value = data[i];
             for (int j = delimiters; j >= 0; j--)
                 if ((int) data[i] < positions[j])
@@ -89,34 +76,45 @@ public:
     }
 
     void write(const char* outfile) {
-        FILE* file = fopen(outfile, "wb");
-        if (file == nullptr) {
+        pnm::Status status = pnm::write(outfile, header, data);
+        if (status == pnm::OpenFailed) {
             cerr << "Cannot open the image file: problems with file";
             exit(1);
         }
-        if (fprintf(file, "P%d\n%d %d\n%d\n", type, width, height, 255) < 0 ||
-            fwrite(data, 1, size, file) != size) {
+        if (status != pnm::Ok) {
             cerr << "Problems with writing image to outfile";
             exit(1);
         }
-        fclose(file);
     }
 
     ~Image() {
-        delete[] data;
+        pnm::release(data);
     }
 
 private:
+    pnm::Header header;
     unsigned char* data;
     vector<double> prefix_p, prefix_fp;
-    int width, height, type, pixelSize = 1, size;
+    size_t size;
 
     void calc_p_and_prefix() {
         vector<int> p(256, 0);
         prefix_p.assign(256, 0);
         prefix_fp.assign(256, 0);
-        for (int i = 0; i < size; i++)
-            p[(int) data[i]]++;
+        // four interleaved histograms, so runs of equal pixels do not serialize on one counter;
+        // the increments are a scatter, so this loop stays scalar
+        vector<int> partial(4 * 256, 0);
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            partial[data[i]]++;
+            partial[256 + data[i + 1]]++;
+            partial[512 + data[i + 2]]++;
+            partial[768 + data[i + 3]]++;
+        }
+        for (; i < size; i++)
+            partial[data[i]]++;
+        for (int i = 0; i < 256; i++)
+            p[i] = partial[i] + partial[256 + i] + partial[512 + i] + partial[768 + i];
         for (int i = 0; i < 256; i++) {
             prefix_p[i] = prefix_p[max(0, i - 1)] + p[i];
             prefix_fp[i] = prefix_fp[max(0, i - 1)] + i * p[i];
@@ -125,11 +123,14 @@ private:
 };
 
 int main(int argc, char* argv[]) {
+    profile::parseFlag(argc, argv);
     if (argc != 4) {
         cerr << "Incorrect arguments count; please enter your image filename, new image filename and classes count (an integer >= 2)";
         exit(1);
     }
+    profile::stage("read");
     Image image(argv[1]);
+    profile::finish();
     int classes;
     try {
         classes = stoi(argv[3]);
@@ -141,7 +142,10 @@ int main(int argc, char* argv[]) {
         cerr << "Incorrect classes count; please enter an int value";
         exit(1);
     }
+    profile::stage("multi_Otsu_tresholding");
     image.multi_Otsu_tresholding(classes - 1);
+    profile::stage("write");
     image.write(argv[2]);
+    profile::finish();
     return 0;
 }
@@ -3,6 +3,8 @@
 #include <cstring>
 #include <cstdio>
 #include "zlib/zlib.h"
+#include "../common/pnm.h"
+#include "../common/profile.h"
 
 using namespace std;
 
@@ -166,7 +168,7 @@ public:
 
 
     void parse_all_IDAT_Data() {
-        int m_width = (pixelSize * width + 1);
+        size_t m_width = ((size_t) pixelSize * width + 1);
         auto rawData = new (nothrow) unsigned char[m_width * height]; // data with filter column
         if (rawData == nullptr) {
             cerr << "Not enough memory for work with .png image";
@@ -187,41 +189,41 @@ public:
         inflate(&inf, Z_NO_FLUSH);
         inflateEnd(&inf);
 
-        data = new (nothrow) unsigned char[pixelSize * height * width];
+        data = pnm::allocate((size_t) pixelSize * height * width);
         if (data == nullptr) {
             cerr << "Not enough memory for work with .png image";
             exit(1);
         }
-        int k = 0;
+        size_t k = 0;
         int delta;
         int dist_u, dist_l, dist_ul;
         int upper, left, upper_left;
 
         for (int i = 0; i < height; i++) {
             int filter = (int) rawData[i * m_width];
-            for (int j = 1; j < m_width; j++) {
+            for (int j = 1; j < (int) m_width; j++) {
                 switch (filter) {
                     case 0: // raw value
                         delta = 0;
                         break;
                     case 1: // + left
-                        delta = (j <= pixelSize) ? 0 : data[i * width * pixelSize + j - pixelSize - 1];
+                        delta = (j <= pixelSize) ? 0 : data[(size_t) i * width * pixelSize + j - pixelSize - 1];
                         break;
                     case 2: // + up
-                        delta = (i == 0) ? 0 : data[(i - 1) * width * pixelSize + j - 1];
+                        delta = (i == 0) ? 0 : data[(size_t) (i - 1) * width * pixelSize + j - 1];
                         break;
                     case 3: // + (left + up) / 2
                         delta = 0;
                         if (i != 0)
-                            delta += data[(i - 1) * width * pixelSize + j - 1];
+                            delta += data[(size_t) (i - 1) * width * pixelSize + j - 1];
                         if (j > pixelSize)
-                            delta += data[i * width * pixelSize + j - pixelSize - 1];
+                            delta += data[(size_t) i * width * pixelSize + j - pixelSize - 1];
                         delta /= 2;
                         break;
                     case 4: // + left | upper | upper_left according to dist between them and (left + upper - upper_left)
-                        upper = (i == 0) ? 0 : data[(i - 1) * width * pixelSize + j - 1];
-                        left = (j <= pixelSize) ? 0 : data[i * width * pixelSize + j - pixelSize - 1];
-                        upper_left = (i == 0 || j <= pixelSize) ? 0 : data[(i - 1) * width * pixelSize + j - pixelSize - 1];
+                        upper = (i == 0) ? 0 : data[(size_t) (i - 1) * width * pixelSize + j - 1];
+                        left = (j <= pixelSize) ? 0 : data[(size_t) i * width * pixelSize + j - pixelSize - 1];
+                        upper_left = (i == 0 || j <= pixelSize) ? 0 : data[(size_t) (i - 1) * width * pixelSize + j - pixelSize - 1];
 
                         delta = upper + left - upper_left;
                         dist_u = abs(delta - upper);
@@ -244,21 +246,23 @@ public:
     }
 
     void write_to_pnm(const char* outfile) {
-        FILE* file = fopen(outfile, "wb");
-        if (file == nullptr) {
+        pnm::Header header;
+        header.type = type;
+        header.width = width;
+        header.height = height;
+        pnm::Status status = pnm::write(outfile, header, data);
+        if (status == pnm::OpenFailed) {
             cerr << "Cannot open the image file: problems with file";
             exit(1);
         }
-        if (fprintf(file, "P%d\n%d %d\n%d\n", type, width, height, 255) < 0 ||
-            fwrite(data, 1, width * height * pixelSize, file) != width * height * pixelSize) {
+        if (status != pnm::Ok) {
             cerr << "Problems with writing image to outfile";
             exit(1);
         }
-        fclose(file);
     }
 
     ~PNGImage() {
-        delete[] data;
+        pnm::release(data);
         delete[] idatData;
     }
 
@@ -269,11 +273,15 @@ private:
 };
 
 int main(int argc, char* argv[]) {
+    profile::parseFlag(argc, argv);
     if (argc != 3) {
         cerr << "Incorrect arguments count; must be 2 files: <input>.png and <output>.pnm";
         exit(1);
     }
+    profile::stage("decode");
     PNGImage image(argv[1]);
+    profile::stage("write_to_pnm");
     image.write_to_pnm(argv[2]);
+    profile::finish();
     return 0;
 }
\ No newline at end of file